@@ -34,16 +34,19 @@ album_art_extractor_instance_ptr ncm_album_art_extractor::open(file_ptr p_filehi
         throw exception_io_unsupported_feature();
     } while (false);
 
-    if (_ncm_file->image_data().empty()) {
-        _ncm_file->parse(ncm_file::parse_targets::NCM_PARSE_ALBUM);
+    if (!_ncm_file->album_image_parsed()) {
+        if (auto err = _ncm_file->try_parse(ncm_file::parse_targets::NCM_PARSE_ALBUM); err != ncm_file::parse_error::ok) {
+            DEBUG_LOG("No album art (", ncm_file::describe(err), "): ", p_path);
+            throw exception_album_art_not_found();
+        }
     }
 
-    if (_ncm_file->image_data().empty()) {
+    auto image = _ncm_file->read_album_image(p_abort);
+    if (image.is_empty()) {
         throw exception_album_art_not_found();
     }
 
     auto album_art_instance = fb2k::service_new<album_art_extractor_instance_simple>();
-    auto image = album_art_data_impl::g_create(_ncm_file->image_data().data(), _ncm_file->image_data().size());
     album_art_instance->set(album_art_ids::cover_front, image);
     // album_art_instance->set(album_art_ids::disc, image);
     return album_art_instance;
@@ -103,10 +106,10 @@ album_art_data_ptr ncm_album_art_editor_instance::query(const GUID &p_what, abor
         throw exception_album_art_unsupported_entry();
     }
     if (cache_album_art_data_.is_empty()) {
-        if (ncm_file_->image_data().empty()) {
-            ncm_file_->parse(ncm_file::parse_targets::NCM_PARSE_ALBUM);
+        cache_album_art_data_ = ncm_file_->read_album_image(p_abort);
+        if (cache_album_art_data_.is_empty()) {
+            throw exception_album_art_not_found();
         }
-        cache_album_art_data_ = album_art_data_impl::g_create(ncm_file_->image_data().data(), ncm_file_->image_data().size());
     }
     return cache_album_art_data_;
 }
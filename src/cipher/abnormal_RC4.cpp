@@ -24,7 +24,7 @@ abnormal_RC4::abnormal_RC4(const uint8_t *seed, size_t len) {
         std::swap(key_box[i], key_box[last]);
     }
     // here is the weired thing, don't think about it, feel it.
-    key_box_ = std::shared_ptr<uint8_t[]>(new uint8_t[256]);
+    key_box_ = std::shared_ptr<uint8_t[]>(new uint8_t[512]);
     for (int i = 0; i < 256; i++) {
         auto k1 = (i + 1) & 0xff;
         auto k2 = (k1 + key_box[k1]) & 0xff;
@@ -32,6 +32,22 @@ abnormal_RC4::abnormal_RC4(const uint8_t *seed, size_t len) {
         // std::swap(key_box[k1],key_box[k2]); <- this step is missing
         auto k = key_box[(key_box[k1] + key_box[k2]) & 0xff];
         key_box_[i] = k;
+        key_box_[i + 256] = k;
+    }
+}
+
+void abnormal_RC4::apply(uint8_t *data, size_t len, size_t offset) const {
+    // in whole periods of the key stream (up to 256 bytes each), plain loops over contiguous bytes that compilers vectorize
+    const uint8_t *ks = key_box_.get();
+    while (len) {
+        const uint8_t *k = ks + (offset & 0xff);
+        const size_t n = std::min<size_t>(len, 256);
+        for (size_t i = 0; i < n; ++i) {
+            data[i] ^= k[i];
+        }
+        data += n;
+        len -= n;
+        offset += n;
     }
 }
 
@@ -29,6 +29,9 @@ namespace fb2k_ncm::cipher
             return *this;
         }
         std::function<uint8_t(uint8_t, size_t)> get_transform() const;
+        /// @brief XOR `len` bytes in place with the key stream starting at `offset`, for any offset and length. The counter is left untouched.
+        /// @note Encryption and decryption are the same operation.
+        void apply(uint8_t *data, size_t len, size_t offset) const;
 
         // c++20 ranges version, returns a transform view
         template <std::ranges::range R>
@@ -42,7 +45,7 @@ namespace fb2k_ncm::cipher
 
     private:
         std::vector<uint8_t> key_seed_;
-        std::shared_ptr<uint8_t[]> key_box_;
+        std::shared_ptr<uint8_t[]> key_box_; // the key stream has a period of 256, stored twice so that any 256 bytes are contiguous
         size_t counter_ = 0; // to keep decrypt indices on track
     };
 
@@ -0,0 +1,100 @@
+#include "stdafx.h"
+#include "meta_codec.hpp"
+
+using namespace fb2k_ncm::cipher;
+
+namespace
+{
+    constexpr char b64_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    constexpr auto b64_reverse = [] {
+        std::array<uint8_t, 256> r{};
+        r.fill(0xff);
+        for (uint8_t i = 0; i < 64; ++i) {
+            r[static_cast<uint8_t>(b64_table[i])] = i;
+        }
+        return r;
+    }();
+} // namespace
+
+size_t meta_codec::base64_encode(const uint8_t *in, size_t n, uint8_t *out) {
+    auto o = out;
+    size_t i = 0;
+    for (; i + 3 <= n; i += 3) {
+        const uint32_t v = (uint32_t(in[i]) << 16) | (uint32_t(in[i + 1]) << 8) | in[i + 2];
+        *o++ = b64_table[v >> 18];
+        *o++ = b64_table[(v >> 12) & 0x3f];
+        *o++ = b64_table[(v >> 6) & 0x3f];
+        *o++ = b64_table[v & 0x3f];
+    }
+    if (const auto rest = n - i; rest) {
+        const uint32_t v = (uint32_t(in[i]) << 16) | (rest == 2 ? uint32_t(in[i + 1]) << 8 : 0);
+        *o++ = b64_table[v >> 18];
+        *o++ = b64_table[(v >> 12) & 0x3f];
+        *o++ = rest == 2 ? b64_table[(v >> 6) & 0x3f] : '=';
+        *o++ = '=';
+    }
+    return o - out;
+}
+
+size_t meta_codec::base64_decode(const uint8_t *in, size_t n, uint8_t *out) {
+    // trailing `=` only
+    while (n && in[n - 1] == '=') {
+        --n;
+    }
+    auto o = out;
+    uint32_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const auto v = b64_reverse[in[i]];
+        if (v == 0xff) [[unlikely]] {
+            return SIZE_MAX;
+        }
+        acc = (acc << 6) | v;
+        if (bits += 6; bits >= 8) {
+            bits -= 8;
+            *o++ = static_cast<uint8_t>(acc >> bits);
+        }
+    }
+    return o - out;
+}
+
+meta_codec::status meta_codec::decode(std::span<const uint8_t> field, std::string &plain) const {
+    if (field.size() < hint_.size()) {
+        return status::hint;
+    }
+    for (size_t i = 0; i < hint_.size(); ++i) {
+        if ((field[i] ^ xor_key) != static_cast<uint8_t>(hint_[i])) {
+            return status::hint;
+        }
+    }
+    const auto payload = field.subspan(hint_.size());
+    std::vector<uint8_t> buffer(payload.begin(), payload.end());
+    std::for_each(buffer.begin(), buffer.end(), [](uint8_t &b) { b ^= xor_key; });
+    // decoded in place, output never overtakes the input
+    const auto size = base64_decode(buffer.data(), buffer.size(), buffer.data());
+    if (size == SIZE_MAX || size < AES_BLOCKSIZE || (size % AES_BLOCKSIZE)) [[unlikely]] {
+        return status::cipher;
+    }
+    size_t total = 0;
+    try {
+        total = make_AES_context_with_key(key_)
+                    .set_chain_mode(aes_chain_mode::ECB)
+                    .set_input(buffer.data(), size)
+                    .set_output(buffer.data(), size)
+                    .decrypt_all()
+                    .outputted_len();
+    } catch (const std::exception &) {
+        return status::cipher;
+    }
+    if (total == 0 || total > size) [[unlikely]] {
+        return status::cipher;
+    }
+    // guess_padding() trusts the last byte, don't let it walk out of the buffer
+    if (const auto padding = buffer[total - 1]; padding > AES_BLOCKSIZE || padding > total) [[unlikely]] {
+        return status::cipher;
+    }
+    total -= guess_padding(buffer.data() + total);
+    plain.assign(reinterpret_cast<const char *>(buffer.data()), total);
+    return status::ok;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "aes.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fb2k_ncm::cipher
+{
+    /// @brief The meta field of ncm files: "<hint><base64>" with every byte XORed by 0x63,
+    /// where the base64 payload is the plain text ("music:<json>"), pkcs#7 padded and encrypted by AES ECB.
+    /// @note The length prefix of the field is not part of it.
+    class meta_codec {
+    public:
+        // A chunk is a multiple of both the AES block (16) and the base64 group (3), so only the last one can end with `=`.
+        static constexpr size_t chunk_size = 48 * 64;
+        static constexpr uint8_t xor_key = 0x63;
+
+        enum class status : uint8_t {
+            ok = 0,
+            hint,   // doesn't start with the hint
+            cipher, // invalid base64, AES payload or padding
+        };
+
+        meta_codec(std::span<const uint8_t> key, std::string_view hint) : key_(key.begin(), key.end()), hint_(hint) {}
+
+        /// @return size of the field for `plain_size` bytes of plain text
+        size_t encoded_size(size_t plain_size) const { return hint_.size() + (aligned(plain_size) + 2) / 3 * 4; }
+
+        /// @brief Encode in one pass over bounded chunks, each one is handed to the sink as soon as it's done.
+        /// @param parts concatenated as the plain text, e.g. {"music:", json}
+        /// @param sink void(const uint8_t *, size_t)
+        template <typename Sink>
+        void encode(std::initializer_list<std::string_view> parts, Sink &&sink) const {
+            size_t plain_size = 0;
+            for (auto part : parts) {
+                plain_size += part.size();
+            }
+            const size_t padded_size = aligned(plain_size);
+            const auto padding = static_cast<uint8_t>(padded_size - plain_size);
+
+            std::array<uint8_t, chunk_size> plain;
+            std::array<uint8_t, chunk_size / 3 * 4> encoded;
+            std::transform(hint_.begin(), hint_.end(), encoded.begin(), [](char c) { return uint8_t(c ^ xor_key); });
+            sink(encoded.data(), hint_.size());
+
+            auto part = parts.begin();
+            size_t part_pos = 0;
+            for (size_t pos = 0; pos < padded_size; pos += chunk_size) {
+                const size_t n = std::min(chunk_size, padded_size - pos);
+                size_t filled = 0;
+                for (; filled < n && part != parts.end();) {
+                    const auto take = std::min(n - filled, part->size() - part_pos);
+                    memcpy(plain.data() + filled, part->data() + part_pos, take);
+                    filled += take;
+                    if (part_pos += take; part_pos == part->size()) {
+                        ++part;
+                        part_pos = 0;
+                    }
+                }
+                memset(plain.data() + filled, padding, n - filled);
+
+                // a context is finished once its input is used up, ECB has no chaining so each chunk gets its own
+                make_AES_context_with_key(key_)
+                    .set_chain_mode(aes_chain_mode::ECB)
+                    .set_input(plain.data(), n)
+                    .set_output(plain.data(), n)
+                    .encrypt_chunk(n);
+                const auto m = base64_encode(plain.data(), n, encoded.data());
+                std::for_each_n(encoded.data(), m, [](uint8_t &b) { b ^= xor_key; });
+                sink(encoded.data(), m);
+            }
+        }
+
+        /// @param plain the decoded plain text, padding removed
+        status decode(std::span<const uint8_t> field, std::string &plain) const;
+
+    private:
+        static size_t base64_encode(const uint8_t *in, size_t n, uint8_t *out);
+        /// @return decoded size, or SIZE_MAX on invalid characters
+        static size_t base64_decode(const uint8_t *in, size_t n, uint8_t *out);
+
+    private:
+        std::vector<uint8_t> key_;
+        std::string hint_;
+    };
+
+} // namespace fb2k_ncm::cipher
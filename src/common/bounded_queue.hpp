@@ -0,0 +1,60 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+namespace fb2k_ncm
+{
+    /// @brief Blocking FIFO with a fixed capacity, connecting two pipeline stages.
+    /// @note close() wakes up both sides: push() fails from then on, pop() drains what's left and then returns std::nullopt.
+    template <typename T>
+    class bounded_queue {
+    public:
+        explicit bounded_queue(size_t capacity) : capacity_(capacity) {}
+
+        /// @return false if the queue has been closed, `item` is dropped then.
+        bool push(T &&item) {
+            std::unique_lock lock(mutex_);
+            not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+            if (closed_) {
+                return false;
+            }
+            items_.emplace_back(std::move(item));
+            lock.unlock();
+            not_empty_.notify_one();
+            return true;
+        }
+
+        std::optional<T> pop() {
+            std::unique_lock lock(mutex_);
+            not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+            if (items_.empty()) {
+                return std::nullopt;
+            }
+            std::optional<T> item(std::move(items_.front()));
+            items_.pop_front();
+            lock.unlock();
+            not_full_.notify_one();
+            return item;
+        }
+
+        void close() {
+            {
+                std::lock_guard lock(mutex_);
+                closed_ = true;
+            }
+            not_full_.notify_all();
+            not_empty_.notify_all();
+        }
+
+    private:
+        const size_t capacity_;
+        std::mutex mutex_;
+        std::condition_variable not_full_, not_empty_;
+        std::deque<T> items_;
+        bool closed_ = false;
+    };
+
+} // namespace fb2k_ncm
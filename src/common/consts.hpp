@@ -17,7 +17,13 @@ constexpr inline GUID guid_candidates[] = {
     {0x0ef1cb99, 0x91ad, 0x486c, {0x82, 0x82, 0xda, 0x70, 0x98, 0x4e, 0xa8, 0x51}}, // input_ncm service, + album_art related
     {0x9c99d51e, 0x1228, 0x4f25, {0x91, 0x63, 0xf1, 0x56, 0x1e, 0x57, 0x5b, 0x13}}, // ncm_file service
     {0xdb2c5ae1, 0x1a4c, 0x4c67, {0xb4, 0x13, 0xc9, 0xd9, 0x46, 0x34, 0xe2, 0xaf}}, // context menu
-    {0xc2cb5fa6, 0x9d9f, 0x47ec, {0xae, 0x3a, 0x18, 0x5f, 0xc7, 0x98, 0xd6, 0x2c}},
+    {0xc2cb5fa6, 0x9d9f, 0x47ec, {0xae, 0x3a, 0x18, 0x5f, 0xc7, 0x98, 0xd6, 0x2c}}, // advconfig branch
+    {0x12b0b03d, 0xa899, 0x404e, {0xa2, 0x6d, 0x55, 0xd0, 0xc1, 0xf1, 0x0a, 0x8f}}, // advconfig: max meta size
+    {0xd0f58e32, 0x76ad, 0x4d12, {0xa5, 0x52, 0x53, 0xbb, 0x0d, 0xf5, 0x71, 0xf2}}, // advconfig: max cached album image size
+    {0x8b3247b6, 0x2336, 0x4844, {0xa2, 0x0f, 0x84, 0x71, 0x59, 0x98, 0x04, 0x17}}, // advconfig: album image slack
+    {0x4d5d431f, 0x56b1, 0x4f46, {0x8f, 0x16, 0x90, 0x39, 0x83, 0xd5, 0x11, 0x57}}, // advconfig: split extraction size
+    {0x78d32624, 0x85b4, 0x47cb, {0x92, 0xce, 0xa3, 0xac, 0x7d, 0x3e, 0x1b, 0xe0}}, // advconfig: uncached extraction
+    {0xfc924bff, 0x74ab, 0x4f42, {0xba, 0xbd, 0x3d, 0x10, 0xdb, 0x57, 0x04, 0x87}}, // advconfig: extraction rate while playing
 };
 
 struct _check_cpp_std {
@@ -53,10 +59,19 @@ namespace fb2k_ncm
     };
 
     constexpr int max_thread_count = 8; // recommended number of threads (hint)
-    constexpr uint64_t max_memfile_size = 20 * 1024 * 1024; // 20MB
+    constexpr size_t tail_move_chunk_size = 4 * 1024 * 1024; // chunk size when shifting audio content behind an edited header
+    constexpr size_t write_buffer_size = 256 * 1024;          // small writes into the audio content are merged up to this size
+    constexpr size_t extract_chunk_size = 1024 * 1024;        // buffer size of each extraction pipeline stage
+    constexpr size_t extract_queue_depth = 4;                 // buffers in flight per extraction
+    constexpr uint64_t min_split_range_size = 64 * 1024 * 1024; // huge files are extracted in ranges no smaller than this
+    constexpr size_t governed_max_in_flight = 2;                // extraction reads at once, while something is playing
+    constexpr uint64_t verify_chunk_size = 16 * 1024 * 1024;   // extracted audio is checksummed in pieces of this size
+    constexpr size_t max_shared_headers = 64;                       // parsed headers kept by ncm_file_registry
+    constexpr uint64_t max_shared_headers_size = 32 * 1024 * 1024; // 32MB, mostly album images
 
     constexpr auto meta_b64_hint = "163 key(Don't modify):"sv;
     constexpr auto overwrite_key = "overwrite"sv;
+    constexpr auto manifest_file_name = "foo_input_ncm.manifest.json"sv; // kept in extraction target directories
     constexpr auto foo_input_ncm_comment_key = "foo_input_ncm_comment"sv;
     constexpr auto foo_input_ncm_comment = "These fields overwrite the original metainfo, "
                                            "handled by <foo_input_ncm> component (" PROJECT_HOST_REPO ")."sv;
@@ -139,5 +154,7 @@ namespace fb2k_ncm
         // reserved, if dynamic names are better
         single_v_map<> extra_single_values;
         multi_v_map<> extra_multi_values;
+
+        bool operator==(const uniform_meta_st &) const = default;
     };
 } // namespace fb2k_ncm
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "helpers.hpp"
+
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace fb2k_ncm::extra_fields
+{
+    using values_t = std::unordered_set<std::string>;
+
+    /// @brief An extra field to write to `overwrite`, nullopt `values` removes it.
+    struct change_st {
+        std::string name;
+        std::optional<values_t> values;
+    };
+
+    /// @brief Extra fields that change `cur` into `target`, as they look like after going through file_info.
+    /// @note
+    /// - file_info doesn't keep the case of names, nor whether a field has one value or many,
+    /// so names are compared case-insensitively and single / multi values are compared as sets.
+    /// - A changed or removed field keeps its spelling in `cur`, so that it replaces the existing member of the meta
+    /// instead of adding a second one next to it. Only new fields are named as `target` names them.
+    inline std::vector<change_st> diff(const std::unordered_map<std::string, std::string> &cur_single,
+                                       const std::unordered_map<std::string, values_t> &cur_multi,
+                                       const std::unordered_map<std::string, std::string> &target_single,
+                                       const std::unordered_map<std::string, values_t> &target_multi) {
+        struct field_st {
+            std::string name; // first spelling seen
+            values_t values;
+        };
+        auto collect = [](const auto &single, const auto &multi) {
+            std::unordered_map<std::string, field_st> r;
+            auto field = [&r](const std::string &name) -> field_st & {
+                auto [it, inserted] = r.try_emplace(upper(name));
+                if (inserted) {
+                    it->second.name = name;
+                }
+                return it->second;
+            };
+            for (const auto &[name, val] : single) {
+                field(name).values.emplace(val);
+            }
+            for (const auto &[name, vals] : multi) {
+                field(name).values.insert(vals.begin(), vals.end());
+            }
+            return r;
+        };
+        const auto cur = collect(cur_single, cur_multi);
+        const auto target = collect(target_single, target_multi);
+
+        std::vector<change_st> changes;
+        for (const auto &[key, field] : target) {
+            if (auto it = cur.find(key); it == cur.end()) {
+                changes.push_back({field.name, field.values});
+            } else if (it->second.values != field.values) {
+                changes.push_back({it->second.name, field.values});
+            }
+        }
+        for (const auto &[key, field] : cur) {
+            if (!target.contains(key)) {
+                changes.push_back({field.name, std::nullopt});
+            }
+        }
+        return changes;
+    }
+
+} // namespace fb2k_ncm::extra_fields
@@ -0,0 +1,143 @@
+#include "stdafx.h"
+#include "io_governor.hpp"
+#include "common/consts.hpp"
+#include "common/log.hpp"
+#include "config.hpp"
+
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <pthread.h>
+#include <pthread/qos.h>
+#endif
+
+using namespace fb2k_ncm;
+using namespace std::chrono_literals;
+
+namespace
+{
+    thread_local int tls_priority_lowered = -1; // unknown yet
+
+    class governor_play_callback : public play_callback_static {
+    public:
+        unsigned get_flags() override { return flag_on_playback_new_track | flag_on_playback_stop | flag_on_playback_pause; }
+        void on_playback_new_track(metadb_handle_ptr p_track) override { io_governor::instance().set_playing(true); }
+        void on_playback_stop(play_control::t_stop_reason p_reason) override {
+            if (p_reason != play_control::stop_reason_starting_another) {
+                io_governor::instance().set_playing(false);
+            }
+        }
+        void on_playback_pause(bool p_state) override { io_governor::instance().set_playing(!p_state); }
+
+        void on_playback_starting(play_control::t_track_command p_command, bool p_paused) override {}
+        void on_playback_seek(double p_time) override {}
+        void on_playback_edited(metadb_handle_ptr p_track) override {}
+        void on_playback_dynamic_info(const file_info &p_info) override {}
+        void on_playback_dynamic_info_track(const file_info &p_info) override {}
+        void on_playback_time(double p_time) override {}
+        void on_volume_change(float p_new_val) override {}
+    };
+} // namespace
+
+static play_callback_static_factory_t<governor_play_callback> g_governor_play_callback;
+
+io_governor &io_governor::instance() {
+    static io_governor governor;
+    return governor;
+}
+
+io_governor::ticket &io_governor::ticket::operator=(ticket &&other) noexcept {
+    if (this != &other) {
+        if (counted_) {
+            io_governor::instance().release();
+        }
+        counted_ = std::exchange(other.counted_, false);
+    }
+    return *this;
+}
+
+io_governor::ticket::~ticket() {
+    if (counted_) {
+        io_governor::instance().release();
+    }
+}
+
+io_governor::ticket io_governor::acquire(size_t bytes, abort_callback &p_abort) {
+    adjust_thread_priority();
+    std::unique_lock lock(mutex_);
+    while (playing_) {
+        if (try_take(bytes)) {
+            return ticket(true);
+        }
+        cv_.wait_for(lock, 20ms);
+        p_abort.check();
+    }
+    return ticket(false);
+}
+
+std::optional<io_governor::ticket> io_governor::try_acquire(size_t bytes) {
+    adjust_thread_priority();
+    std::lock_guard lock(mutex_);
+    if (!playing_) {
+        return ticket(false);
+    }
+    if (try_take(bytes)) {
+        return ticket(true);
+    }
+    return std::nullopt;
+}
+
+bool io_governor::try_take(size_t bytes) {
+    if (in_flight_ >= governed_max_in_flight) {
+        return false;
+    }
+    if (const auto rate = static_cast<double>(config::extraction_rate_while_playing()); rate > 0) {
+        const auto burst = std::max(rate / 4, static_cast<double>(extract_chunk_size));
+        const auto now = std::chrono::steady_clock::now();
+        tokens_ = std::min(burst, tokens_ + std::chrono::duration<double>(now - refilled_at_).count() * rate);
+        refilled_at_ = now;
+        // a read larger than the bucket is let through when the bucket is full, and paid back afterwards
+        if (tokens_ < std::min(static_cast<double>(bytes), burst)) {
+            return false;
+        }
+        tokens_ -= static_cast<double>(bytes);
+    }
+    ++in_flight_;
+    return true;
+}
+
+void io_governor::release() {
+    {
+        std::lock_guard lock(mutex_);
+        if (in_flight_) {
+            --in_flight_;
+        }
+    }
+    cv_.notify_all();
+}
+
+void io_governor::set_playing(bool playing) {
+    if (playing_.exchange(playing) == playing) {
+        return;
+    }
+    DEBUG_LOG("Extraction I/O governor: ", playing ? "playback active, limited" : "playback stopped, unlimited");
+    {
+        std::lock_guard lock(mutex_);
+        tokens_ = 0;
+        refilled_at_ = std::chrono::steady_clock::now();
+    }
+    cv_.notify_all();
+}
+
+void io_governor::adjust_thread_priority() const {
+    const int lowered = playing_ ? 1 : 0;
+    if (tls_priority_lowered == lowered) {
+        return;
+    }
+    tls_priority_lowered = lowered;
+#ifdef _WIN32
+    SetThreadPriority(GetCurrentThread(), lowered ? THREAD_PRIORITY_BELOW_NORMAL : THREAD_PRIORITY_NORMAL);
+#elif defined __APPLE__
+    pthread_set_qos_class_self_np(lowered ? QOS_CLASS_UTILITY : QOS_CLASS_DEFAULT, 0);
+#endif
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "stdafx.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace fb2k_ncm
+{
+    /// @brief Shared by all extraction workers, so that a batch never starves the decoding thread of disk bandwidth.
+    /// @note
+    /// - While something is playing, extraction reads are limited by a token bucket (config::extraction_rate_while_playing())
+    /// and by the number of reads in flight, and the threads asking for tickets run at a lower priority.
+    /// Without playback, tickets are handed out immediately.
+    /// @note
+    /// - The playback state is fed by a play_callback_static (see io_governor.cpp).
+    class io_governor {
+    public:
+        /// @brief Permission for one read, its in-flight slot is held until the ticket is destroyed.
+        class ticket {
+        public:
+            ticket() = default;
+            ticket(ticket &&other) noexcept : counted_(std::exchange(other.counted_, false)) {}
+            ticket &operator=(ticket &&other) noexcept;
+            ticket(const ticket &) = delete;
+            ticket &operator=(const ticket &) = delete;
+            ~ticket();
+
+        private:
+            friend class io_governor;
+            explicit ticket(bool counted) : counted_(counted) {}
+            bool counted_ = false; // false if issued while nothing was playing
+        };
+
+        static io_governor &instance();
+
+        /// @brief Wait until `bytes` may be read.
+        ticket acquire(size_t bytes, abort_callback &p_abort);
+        /// @brief Same as acquire() without waiting, for callers which already hold tickets (waiting could deadlock them).
+        std::optional<ticket> try_acquire(size_t bytes);
+        void set_playing(bool playing);
+        inline bool playing() const { return playing_; }
+
+    private:
+        io_governor() = default;
+        bool try_take(size_t bytes); // with mutex_ held
+        void release();
+        void adjust_thread_priority() const;
+
+    private:
+        std::atomic_bool playing_ = false;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        double tokens_ = 0; // bytes, may go negative after a read larger than the bucket
+        std::chrono::steady_clock::time_point refilled_at_ = std::chrono::steady_clock::now();
+        size_t in_flight_ = 0;
+    };
+
+} // namespace fb2k_ncm
@@ -145,7 +145,9 @@ std::string _forward_strs(Args &&...args) {
 
 extern const struct _spdlog_init_helper_st {
     _spdlog_init_helper_st() {
-        auto dist_sink = std::make_shared<spdlog::sinks::dist_sink_mt>();
+        // NOTE: Every child sink locks itself, and sinks are only added here.
+        // A _mt distributor would serialize all logging threads (e.g. library scanning workers) on one more global mutex.
+        auto dist_sink = std::make_shared<spdlog::sinks::dist_sink_st>();
         auto fb2k_console_sink = std::make_shared<fb2k_console_sink_mt>();
         fb2k_console_sink->set_pattern("[%l] %v");
         dist_sink->add_sink(fb2k_console_sink);
@@ -164,6 +166,8 @@ extern const struct _spdlog_init_helper_st {
 
 #define DEBUG_LOG(...) SPDLOG_DEBUG(_forward_strs(__VA_ARGS__))
 #define DEBUG_LOG_F(...) SPDLOG_DEBUG(__VA_ARGS__)
+#define INFO_LOG(...) SPDLOG_INFO(_forward_strs(__VA_ARGS__))
+#define INFO_LOG_F(...) SPDLOG_INFO(__VA_ARGS__)
 #define WARN_LOG(...) SPDLOG_WARN(_forward_strs(__VA_ARGS__))
 #define WARN_LOG_F(...) SPDLOG_WARN(__VA_ARGS__)
 #define ERROR_LOG(...) SPDLOG_ERROR(_forward_strs(__VA_ARGS__))
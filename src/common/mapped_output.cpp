@@ -0,0 +1,104 @@
+#include "stdafx.h"
+#include "mapped_output.hpp"
+#include "common/log.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace fb2k_ncm;
+
+std::unique_ptr<mapped_output> mapped_output::create(const char *native_path, uint64_t size) {
+    if (size == 0 || size > SIZE_MAX / 2) { // empty files can't be mapped, and huge ones don't fit in 32-bit address spaces
+        return nullptr;
+    }
+    std::unique_ptr<mapped_output> out(new mapped_output());
+    out->size_ = size;
+#ifdef _WIN32
+    out->file_ = CreateFileW(pfc::stringcvt::string_wide_from_utf8(native_path), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                             CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (out->file_ == INVALID_HANDLE_VALUE) {
+        DEBUG_LOG("mapped_output: CreateFileW failed (", GetLastError(), "): ", native_path);
+        return nullptr;
+    }
+    // allocated up front, so that writing to the mapping can't run out of disk space
+    FILE_ALLOCATION_INFO alloc{};
+    alloc.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+    LARGE_INTEGER end{};
+    end.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFileInformationByHandle(out->file_, FileAllocationInfo, &alloc, sizeof(alloc)) ||
+        !SetFilePointerEx(out->file_, end, nullptr, FILE_BEGIN) || !SetEndOfFile(out->file_)) {
+        DEBUG_LOG("mapped_output: allocation failed (", GetLastError(), "): ", native_path);
+        return nullptr;
+    }
+    out->mapping_ = CreateFileMappingW(out->file_, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+    if (!out->mapping_) {
+        DEBUG_LOG("mapped_output: CreateFileMappingW failed (", GetLastError(), "): ", native_path);
+        return nullptr;
+    }
+    out->data_ = static_cast<uint8_t *>(MapViewOfFile(out->mapping_, FILE_MAP_WRITE, 0, 0, 0));
+    if (!out->data_) {
+        DEBUG_LOG("mapped_output: MapViewOfFile failed (", GetLastError(), "): ", native_path);
+        return nullptr;
+    }
+#else
+    out->fd_ = open(native_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out->fd_ < 0) {
+        DEBUG_LOG("mapped_output: open failed (", errno, "): ", native_path);
+        return nullptr;
+    }
+    // allocated up front, so that writing to the mapping can't run out of disk space (SIGBUS)
+#ifdef __APPLE__
+    fstore_t store{F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, static_cast<off_t>(size), 0};
+    if (fcntl(out->fd_, F_PREALLOCATE, &store) == -1) {
+        store.fst_flags = F_ALLOCATEALL;
+        if (fcntl(out->fd_, F_PREALLOCATE, &store) == -1) {
+            DEBUG_LOG("mapped_output: F_PREALLOCATE failed (", errno, "): ", native_path);
+            return nullptr;
+        }
+    }
+#endif
+    if (ftruncate(out->fd_, static_cast<off_t>(size)) != 0) {
+        DEBUG_LOG("mapped_output: ftruncate failed (", errno, "): ", native_path);
+        return nullptr;
+    }
+    auto *p = mmap(nullptr, static_cast<size_t>(size), PROT_READ | PROT_WRITE, MAP_SHARED, out->fd_, 0);
+    if (p == MAP_FAILED) {
+        DEBUG_LOG("mapped_output: mmap failed (", errno, "): ", native_path);
+        return nullptr;
+    }
+    out->data_ = static_cast<uint8_t *>(p);
+#endif
+    return out;
+}
+
+mapped_output::~mapped_output() {
+    close();
+}
+
+void mapped_output::close() {
+#ifdef _WIN32
+    if (data_) {
+        UnmapViewOfFile(data_);
+    }
+    if (mapping_) {
+        CloseHandle(mapping_);
+        mapping_ = nullptr;
+    }
+    if (file_ != INVALID_HANDLE_VALUE) {
+        CloseHandle(file_);
+        file_ = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (data_) {
+        munmap(data_, static_cast<size_t>(size_));
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+#endif
+    data_ = nullptr;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "stdafx.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace fb2k_ncm
+{
+    /// @brief A new local file, pre-allocated at its final size and mapped for writing.
+    /// @note Dirty pages are written back by the OS, unmapping doesn't wait for them.
+    class mapped_output {
+    public:
+        /// @param native_path path of the local filesystem (not a fb2k path), overwritten if exists
+        /// @return nullptr if the file can't be created, allocated or mapped, callers should fall back to file::write() then.
+        static std::unique_ptr<mapped_output> create(const char *native_path, uint64_t size);
+        ~mapped_output();
+        mapped_output(const mapped_output &) = delete;
+        mapped_output &operator=(const mapped_output &) = delete;
+
+        inline uint8_t *data() const { return data_; }
+        inline uint64_t size() const { return size_; }
+        /// @brief Unmap and close, also done by the destructor.
+        void close();
+
+    private:
+        mapped_output() = default;
+
+    private:
+        uint8_t *data_ = nullptr;
+        uint64_t size_ = 0;
+#ifdef _WIN32
+        HANDLE file_ = INVALID_HANDLE_VALUE;
+        HANDLE mapping_ = nullptr;
+#else
+        int fd_ = -1;
+#endif
+    };
+
+} // namespace fb2k_ncm
@@ -0,0 +1,298 @@
+#include "stdafx.h"
+#include "tag_builder.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <string_view>
+
+using namespace fb2k_ncm;
+using namespace std::string_view_literals;
+
+namespace
+{
+    enum flac_block_type : uint8_t {
+        FLAC_STREAMINFO = 0,
+        FLAC_PADDING = 1,
+        FLAC_VORBIS_COMMENT = 4,
+        FLAC_PICTURE = 6,
+    };
+    constexpr uint8_t flac_invalid_block = 127;
+    constexpr uint32_t front_cover = 3; // picture type, same in FLAC and ID3v2
+    constexpr size_t tag_padding = 4096; // room for later edits in place
+
+    void put_be32(std::vector<uint8_t> &out, uint32_t n) {
+        out.insert(out.end(), {uint8_t(n >> 24), uint8_t(n >> 16), uint8_t(n >> 8), uint8_t(n)});
+    }
+
+    void put_le32(std::vector<uint8_t> &out, uint32_t n) {
+        out.insert(out.end(), {uint8_t(n), uint8_t(n >> 8), uint8_t(n >> 16), uint8_t(n >> 24)});
+    }
+
+    void put_syncsafe(std::vector<uint8_t> &out, uint32_t n) {
+        out.insert(out.end(), {uint8_t((n >> 21) & 0x7f), uint8_t((n >> 14) & 0x7f), uint8_t((n >> 7) & 0x7f), uint8_t(n & 0x7f)});
+    }
+
+    void put_bytes(std::vector<uint8_t> &out, std::string_view s) { out.insert(out.end(), s.begin(), s.end()); }
+
+    uint32_t get_be32(const uint8_t *p) { return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3]; }
+
+    uint32_t get_le32(const uint8_t *p) { return uint32_t(p[3]) << 24 | uint32_t(p[2]) << 16 | uint32_t(p[1]) << 8 | p[0]; }
+
+    /// @brief Field names are ASCII in both formats.
+    std::string upper_ascii(std::string_view s) {
+        std::string r(s);
+        for (auto &c : r) {
+            if (c >= 'a' && c <= 'z') {
+                c = static_cast<char>(c - 'a' + 'A');
+            }
+        }
+        return r;
+    }
+
+    bool iequals_ascii(std::string_view a, std::string_view b) {
+        return a.size() == b.size() && upper_ascii(a) == upper_ascii(b);
+    }
+
+    /// @return values of the first field named `name` (case-insensitive), nullptr if there is none
+    const std::vector<std::string> *find_field(const tag_builder::fields_t &fields, std::string_view name) {
+        auto it = std::ranges::find_if(fields, [name](const auto &field) { return iequals_ascii(field.first, name); });
+        return it == fields.end() ? nullptr : &it->second;
+    }
+
+    std::string_view cover_mime(std::span<const uint8_t> cover) {
+        const auto *p = cover.data();
+        const auto n = cover.size();
+        if (n >= 3 && !memcmp(p, "\xff\xd8\xff", 3)) {
+            return "image/jpeg"sv;
+        }
+        if (n >= 8 && !memcmp(p, "\x89PNG\r\n\x1a\n", 8)) {
+            return "image/png"sv;
+        }
+        if (n >= 6 && !memcmp(p, "GIF8", 4)) {
+            return "image/gif"sv;
+        }
+        if (n >= 12 && !memcmp(p, "RIFF", 4) && !memcmp(p + 8, "WEBP", 4)) {
+            return "image/webp"sv;
+        }
+        return "image/"sv; // unknown, allowed by both formats
+    }
+
+    void put_flac_block(std::vector<uint8_t> &out, uint8_t type, std::span<const uint8_t> body) {
+        out.push_back(type & 0x7f);
+        const auto size = static_cast<uint32_t>(body.size());
+        out.insert(out.end(), {uint8_t(size >> 16), uint8_t(size >> 8), uint8_t(size)});
+        out.insert(out.end(), body.begin(), body.end());
+    }
+
+    std::vector<uint8_t> vorbis_comment(std::string_view vendor, const tag_builder::fields_t &fields) {
+        std::vector<uint8_t> body;
+        put_le32(body, static_cast<uint32_t>(vendor.size()));
+        put_bytes(body, vendor);
+        const auto count_at = body.size();
+        put_le32(body, 0); // filled in below
+        uint32_t count = 0;
+        auto add = [&](std::string_view name, std::string_view value) {
+            auto field = upper_ascii(name);
+            field += '=';
+            field += value;
+            put_le32(body, static_cast<uint32_t>(field.size()));
+            put_bytes(body, field);
+            ++count;
+        };
+        for (const auto &[name, values] : fields) {
+            for (const auto &value : values) {
+                add(name, value);
+            }
+        }
+        std::vector<uint8_t> le;
+        put_le32(le, count);
+        std::copy(le.begin(), le.end(), body.begin() + count_at);
+        return body;
+    }
+
+    std::vector<uint8_t> flac_picture(std::span<const uint8_t> cover) {
+        std::vector<uint8_t> body;
+        const auto mime = cover_mime(cover);
+        put_be32(body, front_cover);
+        put_be32(body, static_cast<uint32_t>(mime.size()));
+        put_bytes(body, mime);
+        put_be32(body, 0); // description
+        put_be32(body, 0); // width, height, depth and colors are optional (0)
+        put_be32(body, 0);
+        put_be32(body, 0);
+        put_be32(body, 0);
+        put_be32(body, static_cast<uint32_t>(cover.size()));
+        body.insert(body.end(), cover.begin(), cover.end());
+        return body;
+    }
+
+    /// @brief ID3v2.4 frame IDs of the fields with one, the others are written as TXXX.
+    std::optional<std::string_view> id3v2_frame_id(std::string_view name) {
+        static constexpr std::pair<std::string_view, std::string_view> frames[] = {
+            {"title"sv, "TIT2"sv},    {"artist"sv, "TPE1"sv},       {"album"sv, "TALB"sv},     {"album artist"sv, "TPE2"sv},
+            {"date"sv, "TDRC"sv},     {"genre"sv, "TCON"sv},        {"composer"sv, "TCOM"sv},  {"performer"sv, "TMCL"sv},
+            {"publisher"sv, "TPUB"sv}, {"copyright"sv, "TCOP"sv},   {"bpm"sv, "TBPM"sv},       {"language"sv, "TLAN"sv},
+            {"conductor"sv, "TPE3"sv}, {"lyricist"sv, "TEXT"sv},    {"isrc"sv, "TSRC"sv},      {"encoded by"sv, "TENC"sv},
+        };
+        for (const auto &[field, id] : frames) {
+            if (iequals_ascii(name, field)) {
+                return id;
+            }
+        }
+        return std::nullopt;
+    }
+
+    void put_id3v2_frame(std::vector<uint8_t> &out, std::string_view id, std::span<const uint8_t> body) {
+        put_bytes(out, id);
+        put_syncsafe(out, static_cast<uint32_t>(body.size()));
+        out.insert(out.end(), {0, 0}); // flags
+        out.insert(out.end(), body.begin(), body.end());
+    }
+
+    /// @brief Text frame in UTF-8, multiple values separated by NUL as of ID3v2.4.
+    void put_id3v2_text(std::vector<uint8_t> &out, std::string_view id, const std::vector<std::string_view> &values,
+                        std::string_view description = {}, bool with_description = false) {
+        std::vector<uint8_t> body{3}; // UTF-8
+        if (with_description) {
+            put_bytes(body, description);
+            body.push_back(0);
+        }
+        for (size_t i = 0; i < values.size(); ++i) {
+            if (i) {
+                body.push_back(0);
+            }
+            put_bytes(body, values[i]);
+        }
+        put_id3v2_frame(out, id, body);
+    }
+
+    /// @brief Comment and lyrics frames, with a language and an empty description.
+    void put_id3v2_lang_text(std::vector<uint8_t> &out, std::string_view id, std::string_view text) {
+        std::vector<uint8_t> body{3};
+        put_bytes(body, "XXX"sv); // unknown language
+        body.push_back(0);
+        put_bytes(body, text);
+        put_id3v2_frame(out, id, body);
+    }
+} // namespace
+
+std::optional<uint32_t> tag_builder::flac_block_size(std::span<const uint8_t, 4> header) {
+    if ((header[0] & 0x7f) == flac_invalid_block) {
+        return std::nullopt;
+    }
+    return uint32_t(header[1]) << 16 | uint32_t(header[2]) << 8 | header[3];
+}
+
+bool tag_builder::flac_picture_fits(std::span<const uint8_t> cover) {
+    return 8 * 4 + cover_mime(cover).size() + cover.size() <= flac_max_block_size;
+}
+
+std::optional<std::vector<uint8_t>> tag_builder::flac_header(std::span<const uint8_t> blocks, const fields_t &fields,
+                                                             std::span<const uint8_t> cover) {
+    std::vector<uint8_t> out;
+    put_bytes(out, "fLaC"sv);
+    std::string vendor = "foo_input_ncm";
+    bool has_streaminfo = false;
+    // the front cover of the audio is only replaced by one that can actually be embedded
+    const bool replace_cover = !cover.empty() && flac_picture_fits(cover);
+    for (size_t pos = 0; pos + 4 <= blocks.size();) {
+        const auto size = flac_block_size(blocks.subspan(pos).first<4>());
+        if (!size.has_value() || pos + 4 + *size > blocks.size()) {
+            return std::nullopt;
+        }
+        const uint8_t type = blocks[pos] & 0x7f;
+        const auto body = blocks.subspan(pos + 4, *size);
+        pos += 4 + *size;
+        if (type == FLAC_VORBIS_COMMENT) {
+            // the encoder's vendor string is kept, the comments are replaced
+            if (body.size() >= 4 && get_le32(body.data()) <= body.size() - 4) {
+                vendor.assign(reinterpret_cast<const char *>(body.data()) + 4, get_le32(body.data()));
+            }
+            continue;
+        }
+        if (type == FLAC_PADDING || (type == FLAC_PICTURE && replace_cover && body.size() >= 4 && get_be32(body.data()) == front_cover)) {
+            continue;
+        }
+        has_streaminfo |= type == FLAC_STREAMINFO;
+        put_flac_block(out, type, body);
+    }
+    if (!has_streaminfo) {
+        return std::nullopt;
+    }
+
+    const auto comments = vorbis_comment(vendor, fields);
+    if (comments.size() > flac_max_block_size) {
+        return std::nullopt;
+    }
+    put_flac_block(out, FLAC_VORBIS_COMMENT, comments);
+    if (replace_cover) {
+        put_flac_block(out, FLAC_PICTURE, flac_picture(cover));
+    }
+    // the last block is flagged as such
+    out.push_back(0x80 | FLAC_PADDING);
+    out.insert(out.end(), {uint8_t(tag_padding >> 16), uint8_t(tag_padding >> 8), uint8_t(tag_padding)});
+    out.resize(out.size() + tag_padding);
+    return out;
+}
+
+std::vector<uint8_t> tag_builder::id3v2_tag(const fields_t &fields, std::span<const uint8_t> cover) {
+    std::vector<uint8_t> frames;
+    auto with_total = [&fields](std::string_view number, std::string_view total) {
+        std::string s;
+        if (const auto *n = find_field(fields, number); n && !n->empty()) {
+            s = n->front();
+        }
+        if (const auto *t = find_field(fields, total); t && !t->empty() && !t->front().empty()) {
+            s += '/';
+            s += t->front();
+        }
+        return s;
+    };
+
+    for (const auto &[name, values] : fields) {
+        if (values.empty() || iequals_ascii(name, "totaltracks"sv) || iequals_ascii(name, "totaldiscs"sv)) {
+            continue; // merged into TRCK / TPOS
+        }
+        const std::vector<std::string_view> views(values.begin(), values.end());
+        if (iequals_ascii(name, "tracknumber"sv)) {
+            put_id3v2_text(frames, "TRCK"sv, {with_total("tracknumber"sv, "totaltracks"sv)});
+        } else if (iequals_ascii(name, "discnumber"sv)) {
+            put_id3v2_text(frames, "TPOS"sv, {with_total("discnumber"sv, "totaldiscs"sv)});
+        } else if (iequals_ascii(name, "comment"sv)) {
+            put_id3v2_lang_text(frames, "COMM"sv, values.front());
+        } else if (iequals_ascii(name, "lyrics"sv) || iequals_ascii(name, "unsynced lyrics"sv)) {
+            put_id3v2_lang_text(frames, "USLT"sv, values.front());
+        } else if (auto id = id3v2_frame_id(name); id.has_value()) {
+            put_id3v2_text(frames, *id, views);
+        } else {
+            put_id3v2_text(frames, "TXXX"sv, views, upper_ascii(name), true);
+        }
+    }
+    if (!cover.empty()) {
+        std::vector<uint8_t> body{0}; // ISO-8859-1, only used by the empty description
+        put_bytes(body, cover_mime(cover));
+        body.push_back(0);
+        body.push_back(front_cover);
+        body.push_back(0); // description
+        body.insert(body.end(), cover.begin(), cover.end());
+        put_id3v2_frame(frames, "APIC"sv, body);
+    }
+
+    std::vector<uint8_t> out;
+    put_bytes(out, "ID3"sv);
+    out.insert(out.end(), {4, 0, 0}); // version 2.4.0, no flags
+    put_syncsafe(out, static_cast<uint32_t>(frames.size() + tag_padding));
+    out.insert(out.end(), frames.begin(), frames.end());
+    out.resize(out.size() + tag_padding);
+    return out;
+}
+
+uint64_t tag_builder::id3v2_size(std::span<const uint8_t, 10> head) {
+    if (memcmp(head.data(), "ID3", 3) || head[3] == 0xff || head[4] == 0xff) {
+        return 0;
+    }
+    const uint64_t size = uint64_t(head[6] & 0x7f) << 21 | uint64_t(head[7] & 0x7f) << 14 | uint64_t(head[8] & 0x7f) << 7 | (head[9] & 0x7f);
+    const bool footer = head[5] & 0x10;
+    return 10 + size + (footer ? 10 : 0);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fb2k_ncm
+{
+    /// @brief Builds the tags written in front of the extracted audio by ncm_file::save_tagged_audio(),
+    /// so that converting costs a single sequential write, instead of extracting, retagging and embedding the cover one rewrite each.
+    /// @note
+    /// - The result replaces whatever tags the wrapped audio starts with. Blocks describing the stream itself
+    /// (FLAC STREAMINFO, SEEKTABLE, CUESHEET...) are kept as they are.
+    /// - Works on plain fields and bytes, the caller converts file_info and album art (ReplayGain included).
+    namespace tag_builder
+    {
+        /// @brief Field name and its values, in the order they are written.
+        using fields_t = std::vector<std::pair<std::string, std::vector<std::string>>>;
+
+        constexpr uint32_t flac_max_block_size = 0xffffff;
+        /// @brief Bounds of the FLAC metadata blocks read from the audio, beyond them the stream is treated as corrupt.
+        constexpr uint64_t flac_max_blocks_size = 64 * 1024 * 1024;
+
+        /// @param header the 4-byte header of a FLAC metadata block
+        /// @return size of the block body, nullopt for the invalid block type (127)
+        std::optional<uint32_t> flac_block_size(std::span<const uint8_t, 4> header);
+
+        /// @return whether `cover` fits in a FLAC PICTURE block, it isn't embedded otherwise
+        bool flac_picture_fits(std::span<const uint8_t> cover);
+
+        /// @param blocks the FLAC metadata blocks of the wrapped audio, between "fLaC" and the first frame
+        /// @param cover front cover to embed, the pictures of the audio are kept if it's empty or doesn't fit
+        /// @return "fLaC" and the new metadata blocks, to be followed by the frames.
+        /// nullopt if `blocks` are malformed (truncated, no STREAMINFO) or the tags don't fit in a block.
+        std::optional<std::vector<uint8_t>> flac_header(std::span<const uint8_t> blocks, const fields_t &fields, std::span<const uint8_t> cover);
+
+        /// @return an ID3v2.4 tag, to be followed by the MPEG frames (without their own ID3v2 tag)
+        std::vector<uint8_t> id3v2_tag(const fields_t &fields, std::span<const uint8_t> cover);
+
+        /// @return size of the ID3v2 tag `head` starts with (footer included), 0 if there is none
+        uint64_t id3v2_size(std::span<const uint8_t, 10> head);
+
+    } // namespace tag_builder
+
+} // namespace fb2k_ncm
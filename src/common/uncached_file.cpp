@@ -0,0 +1,158 @@
+#include "stdafx.h"
+#include "uncached_file.hpp"
+#include "common/log.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace fb2k_ncm;
+
+std::unique_ptr<uncached_file> uncached_file::open_read(const char *native_path) {
+    std::unique_ptr<uncached_file> f(new uncached_file());
+#ifdef _WIN32
+    f->file_ = CreateFileW(pfc::stringcvt::string_wide_from_utf8(native_path), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                           OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (f->file_ == INVALID_HANDLE_VALUE) {
+        DEBUG_LOG("uncached_file: CreateFileW failed (", GetLastError(), "): ", native_path);
+        return nullptr;
+    }
+#else
+    f->fd_ = open(native_path, O_RDONLY | O_CLOEXEC);
+    if (f->fd_ < 0) {
+        DEBUG_LOG("uncached_file: open failed (", errno, "): ", native_path);
+        return nullptr;
+    }
+#ifdef __APPLE__
+    if (fcntl(f->fd_, F_NOCACHE, 1) == -1) {
+        DEBUG_LOG("uncached_file: F_NOCACHE failed (", errno, "): ", native_path);
+        return nullptr;
+    }
+#endif
+#endif
+    return f;
+}
+
+std::unique_ptr<uncached_file> uncached_file::create(const char *native_path, uint64_t size) {
+    std::unique_ptr<uncached_file> f(new uncached_file());
+#ifdef _WIN32
+    f->file_ = CreateFileW(pfc::stringcvt::string_wide_from_utf8(native_path), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                           CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, nullptr);
+    if (f->file_ == INVALID_HANDLE_VALUE) {
+        DEBUG_LOG("uncached_file: CreateFileW failed (", GetLastError(), "): ", native_path);
+        return nullptr;
+    }
+    FILE_ALLOCATION_INFO alloc{};
+    alloc.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFileInformationByHandle(f->file_, FileAllocationInfo, &alloc, sizeof(alloc))) {
+        DEBUG_LOG("uncached_file: allocation failed (", GetLastError(), "): ", native_path);
+        return nullptr;
+    }
+#else
+    f->fd_ = open(native_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (f->fd_ < 0) {
+        DEBUG_LOG("uncached_file: open failed (", errno, "): ", native_path);
+        return nullptr;
+    }
+#ifdef __APPLE__
+    if (fcntl(f->fd_, F_NOCACHE, 1) == -1) {
+        DEBUG_LOG("uncached_file: F_NOCACHE failed (", errno, "): ", native_path);
+        return nullptr;
+    }
+    fstore_t store{F_ALLOCATEALL, F_PEOFPOSMODE, 0, static_cast<off_t>(size), 0};
+    if (size && fcntl(f->fd_, F_PREALLOCATE, &store) == -1) {
+        DEBUG_LOG("uncached_file: F_PREALLOCATE failed (", errno, "): ", native_path);
+        return nullptr;
+    }
+#endif
+#endif
+    return f;
+}
+
+uncached_file::~uncached_file() {
+#ifdef _WIN32
+    if (file_ != INVALID_HANDLE_VALUE) {
+        CloseHandle(file_);
+    }
+#else
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+#endif
+}
+
+size_t uncached_file::read_at(void *buffer, size_t len, uint64_t offset) {
+    size_t total = 0;
+    while (total < len) {
+#ifdef _WIN32
+        OVERLAPPED ov{}; // positional read on a synchronous handle
+        ov.Offset = static_cast<DWORD>(offset + total);
+        ov.OffsetHigh = static_cast<DWORD>((offset + total) >> 32);
+        DWORD n = 0;
+        if (!ReadFile(file_, static_cast<uint8_t *>(buffer) + total, static_cast<DWORD>(len - total), &n, &ov)) {
+            if (GetLastError() == ERROR_HANDLE_EOF) {
+                break;
+            }
+            throw exception_io();
+        }
+#else
+        auto n = pread(fd_, static_cast<uint8_t *>(buffer) + total, len - total, static_cast<off_t>(offset + total));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw exception_io();
+        }
+#endif
+        if (n == 0) {
+            break;
+        }
+        total += static_cast<size_t>(n);
+        if (total % alignment) { // a short read that isn't aligned only happens at the end of file
+            break;
+        }
+    }
+    return total;
+}
+
+void uncached_file::write_at(const void *buffer, size_t len, uint64_t offset) {
+    size_t total = 0;
+    while (total < len) {
+#ifdef _WIN32
+        OVERLAPPED ov{};
+        ov.Offset = static_cast<DWORD>(offset + total);
+        ov.OffsetHigh = static_cast<DWORD>((offset + total) >> 32);
+        DWORD n = 0;
+        if (!WriteFile(file_, static_cast<const uint8_t *>(buffer) + total, static_cast<DWORD>(len - total), &n, &ov)) {
+            throw exception_io();
+        }
+#else
+        auto n = pwrite(fd_, static_cast<const uint8_t *>(buffer) + total, len - total, static_cast<off_t>(offset + total));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw exception_io();
+        }
+#endif
+        if (n == 0) {
+            throw exception_io();
+        }
+        total += static_cast<size_t>(n);
+    }
+}
+
+void uncached_file::truncate(uint64_t size) {
+#ifdef _WIN32
+    FILE_END_OF_FILE_INFO eof{};
+    eof.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFileInformationByHandle(file_, FileEndOfFileInfo, &eof, sizeof(eof))) {
+        throw exception_io();
+    }
+#else
+    if (ftruncate(fd_, static_cast<off_t>(size)) != 0) {
+        throw exception_io();
+    }
+#endif
+}
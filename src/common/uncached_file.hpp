@@ -0,0 +1,43 @@
+#pragma once
+
+#include "stdafx.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace fb2k_ncm
+{
+    /// @brief Local file for bulk transfers bypassing the system cache (FILE_FLAG_NO_BUFFERING on Windows, F_NOCACHE on macOS),
+    /// so that data read once and written once doesn't evict what the player needs.
+    /// @attention Offsets, lengths and buffer addresses of read_at() / write_at() must be multiples of `alignment`.
+    /// I/O errors are thrown as exception_io.
+    class uncached_file {
+    public:
+        static constexpr size_t alignment = 4096; // covers the sector size of common disks, and the page size
+
+        /// @return nullptr if the file can't be opened uncached, callers should fall back to the fb2k filesystem then.
+        static std::unique_ptr<uncached_file> open_read(const char *native_path);
+        /// @brief Create (or overwrite) a file, pre-allocated at `size`.
+        static std::unique_ptr<uncached_file> create(const char *native_path, uint64_t size);
+        ~uncached_file();
+        uncached_file(const uncached_file &) = delete;
+        uncached_file &operator=(const uncached_file &) = delete;
+
+        /// @return bytes read, less than `len` only at the end of file.
+        size_t read_at(void *buffer, size_t len, uint64_t offset);
+        void write_at(const void *buffer, size_t len, uint64_t offset);
+        /// @brief Set the final size, e.g. to cut off the padding of the last aligned write.
+        void truncate(uint64_t size);
+
+    private:
+        uncached_file() = default;
+
+    private:
+#ifdef _WIN32
+        HANDLE file_ = INVALID_HANDLE_VALUE;
+#else
+        int fd_ = -1;
+#endif
+    };
+
+} // namespace fb2k_ncm
@@ -0,0 +1,221 @@
+#include "stdafx.h"
+#include "worker_pool.hpp"
+#include "common/consts.hpp"
+#include "common/log.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <latch>
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+using namespace fb2k_ncm;
+
+namespace
+{
+    uint64_t thread_cpu_time_ns() {
+#ifdef _WIN32
+        FILETIME creation, exit, kernel, user;
+        if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+            return 0;
+        }
+        auto to_u64 = [](const FILETIME &t) { return (uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+        return (to_u64(kernel) + to_u64(user)) * 100; // 100ns ticks
+#else
+        timespec ts{};
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+            return 0;
+        }
+        return uint64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+#endif
+    }
+
+    thread_local size_t tls_worker_index = SIZE_MAX; // set on the pool's own threads
+
+    void run_task(std::function<void()> &fn) {
+        try {
+            fn();
+        } catch (const std::exception &e) {
+            ERROR_LOG("Worker task failed: ", e.what());
+        }
+    }
+
+    class worker_pool_initquit : public initquit {
+    public:
+        void on_init() override {}
+        void on_quit() override { worker_pool::instance().shutdown(); }
+    };
+} // namespace
+
+static initquit_factory_t<worker_pool_initquit> g_worker_pool_initquit;
+
+worker_pool &worker_pool::instance() {
+    static worker_pool pool;
+    return pool;
+}
+
+worker_pool::~worker_pool() {
+    shutdown();
+}
+
+/// @note Called with mutex_ held.
+void worker_pool::start() {
+    started_ = true;
+    cores_ = std::thread::hardware_concurrency();
+    if (cores_ == 0) {
+        cores_ = max_thread_count;
+    }
+    active_limit_ = cores_;
+    // the extra threads are only used when tasks turn out to be waiting on I/O
+    for (size_t i = 0; i < cores_ * 2; ++i) {
+        workers_.emplace_back(std::make_unique<worker_st>());
+    }
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        workers_[i]->thread = std::thread(&worker_pool::worker_main, this, i);
+    }
+    DEBUG_LOG("Worker pool started: ", workers_.size(), " threads, ", cores_, " cores.");
+}
+
+void worker_pool::shutdown() {
+    {
+        std::lock_guard lock(mutex_);
+        if (stopped_) {
+            return;
+        }
+        stopped_ = true;
+    }
+    cv_.notify_all();
+    for (auto &w : workers_) {
+        if (w->thread.joinable()) {
+            w->thread.join();
+        }
+    }
+    DEBUG_LOG("Worker pool stopped.");
+}
+
+void worker_pool::run_batch(std::vector<task_st> &&tasks) {
+    if (tasks.empty()) {
+        return;
+    }
+    std::latch done(static_cast<std::ptrdiff_t>(tasks.size()));
+    std::ranges::stable_sort(tasks, std::ranges::greater{}, &task_st::weight);
+    {
+        std::unique_lock lock(mutex_);
+        if (stopped_) { // quitting, nobody is going to pick them up
+            lock.unlock();
+            for (auto &t : tasks) {
+                run_task(t.fn);
+            }
+            return;
+        }
+        if (!started_) {
+            start();
+        }
+        // dealt round-robin, so that each deque is sorted heaviest first as well
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            auto &w = *workers_[i % workers_.size()];
+            std::lock_guard w_lock(w.mutex);
+            w.tasks.push_back({tasks[i].weight, [&done, fn = std::move(tasks[i].fn)]() mutable {
+                                   run_task(fn);
+                                   done.count_down();
+                               }});
+        }
+        queued_ += tasks.size();
+    }
+    cv_.notify_all();
+    if (tls_worker_index == SIZE_MAX) {
+        done.wait();
+        return;
+    }
+    // Called from a task (e.g. a huge file split into ranges): help instead of blocking,
+    // otherwise nested batches could occupy all the workers and wait for each other.
+    // This thread is already counted in running_, so the tasks it runs here are not.
+    for (;;) {
+        task_st task;
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [this, &done] { return queued_ > 0 || done.try_wait(); });
+            if (done.try_wait()) {
+                return;
+            }
+            take(tls_worker_index, task);
+        }
+        task.fn();
+        {
+            // the latch of another helper's batch may just have been released, it checks it under mutex_,
+            // so don't notify before it has either seen it or gone to sleep
+            std::lock_guard lock(mutex_);
+        }
+        cv_.notify_all();
+    }
+}
+
+/// @note Called with mutex_ held and queued_ > 0. Tasks are pushed before queued_ is raised, so one is always found.
+void worker_pool::take(size_t index, task_st &out) {
+    --queued_;
+    {
+        auto &own = *workers_[index];
+        std::lock_guard lock(own.mutex);
+        if (!own.tasks.empty()) {
+            out = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            return;
+        }
+    }
+    for (size_t i = 1; i < workers_.size(); ++i) {
+        auto &victim = *workers_[(index + i) % workers_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            out = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            return;
+        }
+    }
+}
+
+void worker_pool::worker_main(size_t index) {
+    tls_worker_index = index;
+    for (;;) {
+        task_st task;
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [this] { return (stopped_ || running_ < active_limit_) && (queued_ > 0 || stopped_); });
+            if (queued_ == 0) { // stopped and drained
+                return;
+            }
+            take(index, task);
+            ++running_;
+        }
+
+        auto wall_begin = std::chrono::steady_clock::now();
+        auto cpu_begin = thread_cpu_time_ns();
+        task.fn();
+        auto cpu = thread_cpu_time_ns() - cpu_begin;
+        auto wall = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - wall_begin).count();
+
+        {
+            std::lock_guard lock(mutex_);
+            --running_;
+            update_limit(cpu, static_cast<uint64_t>(wall));
+        }
+        cv_.notify_all();
+    }
+}
+
+/// @note Called with mutex_ held.
+void worker_pool::update_limit(uint64_t cpu_ns, uint64_t wall_ns) {
+    if (wall_ns < 50'000'000) { // too short to tell anything (e.g. skipped files)
+        return;
+    }
+    cpu_usage_ = cpu_usage_ * 0.7 + std::min(1.0, double(cpu_ns) / double(wall_ns)) * 0.3;
+    // e.g. tasks using half a core run 2 per core, capped by the number of started threads
+    auto limit = static_cast<size_t>(std::lround(double(cores_) / std::max(cpu_usage_, 0.25)));
+    limit = std::clamp(limit, size_t(1), workers_.size());
+    if (limit != active_limit_) {
+        DEBUG_LOG_F("Worker pool: cpu usage {:.2f}, running up to {} tasks.", cpu_usage_, limit);
+        active_limit_ = limit;
+    }
+}
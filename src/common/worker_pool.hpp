@@ -0,0 +1,68 @@
+#pragma once
+
+#include "stdafx.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fb2k_ncm
+{
+    /// @brief Component-wide worker threads for batch jobs (e.g. extraction), started on first use and joined on quit.
+    /// @note
+    /// - Every worker owns a deque. It takes the heaviest task from the front of its own deque,
+    /// and steals the lightest one from the back of the others when it runs dry.
+    /// Tasks of a batch are dealt heaviest first, so big files start early and small ones fill the gaps at the end.
+    /// @note
+    /// - The number of tasks running at once follows the measured CPU usage of finished tasks:
+    /// CPU bound tasks run one per core, tasks waiting on I/O run more (up to 2 per core).
+    class worker_pool {
+    public:
+        struct task_st {
+            uint64_t weight = 0; // e.g. file size, heavier tasks are started first
+            std::function<void()> fn;
+        };
+
+        static worker_pool &instance();
+
+        /// @brief Run all tasks and wait for them to finish.
+        /// @attention Tasks are expected to handle their own errors, exceptions escaping from a task are logged and dropped.
+        /// @note Can be called from a task, the worker then runs queued tasks while waiting.
+        void run_batch(std::vector<task_st> &&tasks);
+        /// @brief Join all workers. Queued tasks are still run, later batches run on the calling thread.
+        void shutdown();
+        size_t concurrency() const { return active_limit_; }
+
+    private:
+        worker_pool() = default;
+        ~worker_pool();
+        void start();
+        void worker_main(size_t index);
+        void take(size_t index, task_st &out);
+        void update_limit(uint64_t cpu_ns, uint64_t wall_ns);
+
+    private:
+        struct worker_st {
+            std::mutex mutex;
+            std::deque<task_st> tasks;
+            std::thread thread;
+        };
+        std::vector<std::unique_ptr<worker_st>> workers_;
+        std::mutex mutex_; // guards the counters below, and wakes up idle workers
+        std::condition_variable cv_;
+        size_t queued_ = 0;
+        size_t running_ = 0;
+        bool started_ = false;
+        bool stopped_ = false;
+        size_t cores_ = 1;
+        double cpu_usage_ = 1.0; // moving average of cpu time / wall time per task
+        std::atomic<size_t> active_limit_ = 1;
+    };
+
+} // namespace fb2k_ncm
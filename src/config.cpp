@@ -0,0 +1,55 @@
+#include "stdafx.h"
+#include "config.hpp"
+#include "common/consts.hpp"
+
+namespace
+{
+    // Preferences -> Advanced -> Decoding -> NCM Loader
+    advconfig_branch_factory g_branch("NCM Loader", guid_candidates[3], advconfig_branch::guid_branch_decoding, 0);
+
+    // NOTE:
+    // Length fields in the header are untrusted, these caps keep a single corrupt file from allocating gigabytes.
+    // Real world meta infos are a few KB, album images are usually under 1MB.
+    advconfig_integer_factory g_max_meta_kb("Max meta info size (KB)", guid_candidates[4], guid_candidates[3], 0, 1024, 1, 64 * 1024);
+    advconfig_integer_factory g_max_album_image_kb("Max cached album image size (KB)", guid_candidates[5], guid_candidates[3], 1, 8 * 1024, 0,
+                                                   256 * 1024);
+
+    // Space kept after the album image for later edits, so that retagging won't move the audio content every time.
+    advconfig_integer_factory g_album_image_slack_kb("Reserved header space for tag edits (KB)", guid_candidates[6], guid_candidates[3], 2, 16,
+                                                     0, 1024);
+
+    // A single huge file (e.g. an hour long hi-res mix) would otherwise be decrypted on one core while the rest of the batch is done.
+    advconfig_integer_factory g_split_extraction_mb("Extract files larger than this with multiple threads (MB, 0 = never)",
+                                                    guid_candidates[7], guid_candidates[3], 3, 256, 0, 64 * 1024);
+
+    // Converting a whole library reads and writes hundreds of GB exactly once, which would push everything else out of the cache.
+    advconfig_checkbox_factory g_uncached_extraction("Bypass system cache when extracting", guid_candidates[8], guid_candidates[3], 4, false);
+
+    // Leaves the decoding thread enough of the disk to avoid dropouts, lifted as soon as playback stops.
+    advconfig_integer_factory g_extraction_rate_mb("Extraction speed limit during playback (MB/s, 0 = unlimited)", guid_candidates[9],
+                                                   guid_candidates[3], 5, 16, 0, 4096);
+} // namespace
+
+uint64_t fb2k_ncm::config::max_meta_size() {
+    return g_max_meta_kb.get() * 1024;
+}
+
+uint64_t fb2k_ncm::config::max_album_image_size() {
+    return g_max_album_image_kb.get() * 1024;
+}
+
+uint64_t fb2k_ncm::config::album_image_slack() {
+    return g_album_image_slack_kb.get() * 1024;
+}
+
+uint64_t fb2k_ncm::config::split_extraction_size() {
+    return g_split_extraction_mb.get() * 1024 * 1024;
+}
+
+bool fb2k_ncm::config::uncached_extraction() {
+    return g_uncached_extraction.get();
+}
+
+uint64_t fb2k_ncm::config::extraction_rate_while_playing() {
+    return g_extraction_rate_mb.get() * 1024 * 1024;
+}
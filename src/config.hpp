@@ -0,0 +1,22 @@
+#pragma once
+
+#include "stdafx.h"
+
+#include <cstdint>
+
+namespace fb2k_ncm::config
+{
+    /// @brief Meta fields larger than this are treated as corrupt (bytes).
+    uint64_t max_meta_size();
+    /// @brief Album images larger than this are not kept in memory by parse(), but read on demand (bytes).
+    uint64_t max_album_image_size();
+    /// @brief Padding reserved after the album image when an edit has to move the audio content anyway (bytes).
+    uint64_t album_image_slack();
+    /// @brief Files with more audio content than this are extracted by several workers at once, 0 = never (bytes).
+    uint64_t split_extraction_size();
+    /// @brief Extract local files bypassing the system cache.
+    bool uncached_extraction();
+    /// @brief Read bandwidth of all extraction workers together while something is playing, 0 = unlimited (bytes per second).
+    uint64_t extraction_rate_while_playing();
+
+} // namespace fb2k_ncm::config
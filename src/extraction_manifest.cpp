@@ -0,0 +1,179 @@
+#include "stdafx.h"
+#include "extraction_manifest.hpp"
+#include "common/log.hpp"
+#include "nlohmann/json.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace fb2k_ncm;
+using namespace std::chrono_literals;
+
+void chunk_hasher::update(const uint8_t *data, size_t len) {
+    constexpr uint64_t prime = 0x100000001b3;
+    size_ += len;
+    if (carry_len_) {
+        const auto n = std::min(len, sizeof(carry_) - carry_len_);
+        std::memcpy(carry_ + carry_len_, data, n);
+        carry_len_ += n;
+        data += n;
+        len -= n;
+        if (carry_len_ < sizeof(carry_)) {
+            return;
+        }
+        uint64_t word;
+        std::memcpy(&word, carry_, sizeof(word));
+        state_ = (state_ ^ word) * prime;
+        carry_len_ = 0;
+    }
+    for (; len >= sizeof(uint64_t); data += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        state_ = (state_ ^ word) * prime;
+    }
+    std::memcpy(carry_, data, len);
+    carry_len_ = len;
+}
+
+uint64_t chunk_hasher::digest() const {
+    constexpr uint64_t prime = 0x100000001b3;
+    auto h = state_;
+    for (size_t i = 0; i < carry_len_; ++i) {
+        h = (h ^ carry_[i]) * prime;
+    }
+    h = (h ^ size_) * prime;
+    return h ? h : 1; // 0 means "not written" in the manifest
+}
+
+extraction_manifest::extraction_manifest(const char *dir, abort_callback &p_abort) : path_(dir) {
+    path_.add_filename(manifest_file_name.data());
+    try {
+        if (!filesystem::g_exists(path_, p_abort)) {
+            return;
+        }
+        file_ptr f;
+        filesystem::g_open_read(f, path_, p_abort);
+        pfc::string8 text;
+        f->read_string_raw(text, p_abort);
+        auto root = nlohmann::json::parse(text.c_str(), nullptr, false);
+        if (!root.is_object() || !root.contains("entries") || !root["entries"].is_object()) {
+            WARN_LOG("Ignored corrupt extraction manifest: ", path_);
+            return;
+        }
+        for (const auto &[source, e] : root["entries"].items()) {
+            entry_st entry;
+            entry.source_size = e.value("source_size", uint64_t(0));
+            entry.source_timestamp = e.value("source_timestamp", filetimestamp_invalid);
+            entry.header_hash = e.value("header_hash", uint64_t(0));
+            entry.output = e.value("output", std::string());
+            entry.output_size = e.value("output_size", uint64_t(0));
+            entry.checksum = e.value("checksum", uint64_t(0));
+            entry.chunks = e.value("chunks", std::vector<uint64_t>());
+            entry.complete = e.value("complete", false);
+            entry.post_processed = e.value("post_processed", false);
+            if (e.value("chunk_size", uint64_t(0)) != verify_chunk_size) { // written by another version, hashes don't apply
+                entry.chunks.clear();
+            }
+            entries_.emplace(source, std::move(entry));
+        }
+        DEBUG_LOG("Loaded extraction manifest (", entries_.size(), " entries): ", path_);
+    } catch (const std::exception &e) {
+        WARN_LOG("Ignored extraction manifest (", e.what(), "): ", path_);
+        entries_.clear();
+    }
+}
+
+std::optional<extraction_manifest::entry_st> extraction_manifest::find(const std::string &source) const {
+    std::lock_guard lock(mutex_);
+    if (auto it = entries_.find(source); it != entries_.end()) {
+        return it->second;
+    }
+    return std::nullopt;
+}
+
+void extraction_manifest::update(const std::string &source, entry_st entry) {
+    std::lock_guard lock(mutex_);
+    entries_[source] = std::move(entry);
+    dirty_ = true;
+}
+
+void extraction_manifest::set_chunk(const std::string &source, size_t index, uint64_t hash) {
+    std::lock_guard lock(mutex_);
+    if (auto it = entries_.find(source); it != entries_.end() && index < it->second.chunks.size()) {
+        it->second.chunks[index] = hash;
+        dirty_ = true;
+    }
+}
+
+void extraction_manifest::save(bool force) {
+    std::lock_guard lock(mutex_);
+    if (!dirty_ || (!force && std::chrono::steady_clock::now() - saved_at_ < 5s)) {
+        return;
+    }
+    auto root = nlohmann::json::object();
+    auto &entries = root["entries"] = nlohmann::json::object();
+    for (const auto &[source, entry] : entries_) {
+        entries[source] = {
+            {"source_size", entry.source_size},
+            {"source_timestamp", entry.source_timestamp},
+            {"header_hash", entry.header_hash},
+            {"output", entry.output},
+            {"output_size", entry.output_size},
+            {"checksum", entry.checksum},
+            {"chunk_size", verify_chunk_size},
+            {"chunks", entry.chunks},
+            {"complete", entry.complete},
+            {"post_processed", entry.post_processed},
+        };
+    }
+    // written aside and moved over, so that a crash never leaves a truncated manifest
+    pfc::string8 tmp_path = path_;
+    tmp_path += ".tmp";
+    try {
+        const auto text = root.dump(1);
+        {
+            file_ptr f;
+            filesystem::g_open_write_new(f, tmp_path, fb2k::noAbort);
+            f->write(text.data(), text.size(), fb2k::noAbort);
+        }
+        filesystem::get(path_)->move_overwrite(tmp_path, path_, fb2k::noAbort);
+        dirty_ = false;
+        saved_at_ = std::chrono::steady_clock::now();
+    } catch (const std::exception &e) {
+        WARN_LOG("Failed to save extraction manifest (", e.what(), "): ", path_);
+    }
+}
+
+void chunk_tracker::feed(uint64_t offset, const uint8_t *data, size_t len) {
+    while (len) {
+        const auto index = static_cast<size_t>(offset / verify_chunk_size);
+        const auto piece_end = std::min<uint64_t>((index + 1) * verify_chunk_size, size_);
+        const auto n = static_cast<size_t>(std::min<uint64_t>(len, piece_end - offset));
+        piece_st *piece = nullptr;
+        {
+            std::lock_guard lock(mutex_);
+            auto [it, inserted] = pieces_.try_emplace(index);
+            if (inserted) {
+                it->second.next = uint64_t(index) * verify_chunk_size;
+            }
+            piece = &it->second; // stable, and only touched by the thread writing this piece
+        }
+        if (piece->next == offset) {
+            piece->hasher.update(data, n);
+            piece->next += n;
+        } else [[unlikely]] {
+            // not fed in order, the piece is left unrecorded and extracted again on resume
+            piece->next = UINT64_MAX;
+        }
+        if (offset + n == piece_end) {
+            if (piece->next == piece_end) {
+                manifest_.set_chunk(source_, index, piece->hasher.digest());
+            }
+            std::lock_guard lock(mutex_);
+            pieces_.erase(index);
+        }
+        offset += n;
+        data += n;
+        len -= n;
+    }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "stdafx.h"
+#include "common/consts.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fb2k_ncm
+{
+    /// @brief Streaming 64-bit hash (FNV-1a over 8-byte words) for checksums of extracted audio, not for security.
+    class chunk_hasher {
+    public:
+        void update(const uint8_t *data, size_t len);
+        uint64_t digest() const;
+        inline uint64_t size() const { return size_; }
+
+    private:
+        uint64_t state_ = 0xcbf29ce484222325;
+        uint64_t size_ = 0;
+        uint8_t carry_[8]{};
+        size_t carry_len_ = 0;
+    };
+
+    /// @brief What has been extracted into a directory, kept there as `manifest_file_name`.
+    /// @note
+    /// - Sources are identified by path, size, timestamp and a hash of the ncm header.
+    /// Outputs are checked by a hash of every `verify_chunk_size` piece, recorded as soon as the piece is written,
+    /// so an aborted extraction can continue behind the last piece that still matches.
+    /// @note
+    /// - Thread-safe, shared by all workers of a batch.
+    class extraction_manifest {
+    public:
+        struct entry_st {
+            uint64_t source_size = 0;
+            t_filetimestamp source_timestamp = filetimestamp_invalid;
+            uint64_t header_hash = 0;
+            std::string output;
+            uint64_t output_size = 0;
+            uint64_t checksum = 0;        // of all chunk hashes, once complete
+            std::vector<uint64_t> chunks; // hash of each verify_chunk_size piece of the output, 0 = not written yet
+            bool complete = false;
+            bool post_processed = false; // the output carries tags (ncm_file::save_tagged_audio()), no chunk hashes then
+
+            bool same_source(const entry_st &other) const {
+                return source_size == other.source_size && source_timestamp == other.source_timestamp && header_hash == other.header_hash;
+            }
+        };
+
+        /// @brief Loads the manifest of `dir` if there is one. A corrupt manifest is ignored (everything is extracted again).
+        explicit extraction_manifest(const char *dir, abort_callback &p_abort = fb2k::noAbort);
+
+        std::optional<entry_st> find(const std::string &source) const;
+        void update(const std::string &source, entry_st entry);
+        void set_chunk(const std::string &source, size_t index, uint64_t hash);
+        /// @brief Write to disk, at most every few seconds unless `force`d. Failures are logged, not thrown.
+        void save(bool force = false);
+
+    private:
+        pfc::string8 path_;
+        mutable std::mutex mutex_;
+        std::unordered_map<std::string, entry_st> entries_;
+        bool dirty_ = false;
+        std::chrono::steady_clock::time_point saved_at_ = std::chrono::steady_clock::now();
+    };
+
+    /// @brief Hashes the decrypted audio as it's produced, and records every finished piece in the manifest.
+    /// @note A piece is expected to be fed sequentially from its start (split ranges and resume points are aligned to verify_chunk_size),
+    /// different pieces may be fed by different threads at once. A piece fed out of order is not recorded.
+    class chunk_tracker {
+    public:
+        chunk_tracker(extraction_manifest &manifest, std::string source, uint64_t size)
+            : manifest_(manifest), source_(std::move(source)), size_(size) {}
+        void feed(uint64_t offset, const uint8_t *data, size_t len);
+
+    private:
+        extraction_manifest &manifest_;
+        const std::string source_;
+        const uint64_t size_;
+        std::mutex mutex_;
+        struct piece_st {
+            chunk_hasher hasher;
+            uint64_t next = 0; // offset expected by the next feed
+        };
+        std::unordered_map<size_t, piece_st> pieces_; // being written
+    };
+
+} // namespace fb2k_ncm
@@ -7,9 +7,28 @@
 #include <sstream>
 #include <algorithm>
 #include <unordered_set>
+#include <atomic>
 
 using namespace fb2k_ncm;
 
+namespace
+{
+    // Files of the running tag update that needed no rewrite, see retag().
+    // The batch itself is run by the core, which reports its end through metadb_io_edit_callback.
+    std::atomic_size_t g_retag_skipped = 0;
+
+    class retag_batch_callback : public metadb_io_edit_callback {
+    public:
+        void on_edited(metadb_handle_list_cref p_items, t_infosref p_before, t_infosref p_after) override {
+            if (auto skipped = g_retag_skipped.exchange(0); skipped) {
+                INFO_LOG("Tag update finished: ", skipped, " of ", p_items.get_count(), " files unchanged, skipped writing.");
+            }
+        }
+    };
+} // namespace
+
+static service_factory_single_t<retag_batch_callback> g_retag_batch_callback;
+
 inline const char *fb2k_ncm::input_ncm::g_get_name() {
     return "Netease Music Specific Format (*.ncm) Decoder";
 }
@@ -37,52 +56,39 @@ void fb2k_ncm::input_ncm::retag(const file_info &p_info, abort_callback &p_abort
     // Replay Gain
     file_info_impl cur_file_info;
     source_info_writer_->get_info(0, cur_file_info, p_abort);
-    cur_file_info.set_replaygain(p_info.get_replaygain());
-    source_info_writer_->set_info(0, cur_file_info, p_abort);
-    source_info_writer_->commit(p_abort);
+    if (cur_file_info.get_replaygain() != p_info.get_replaygain()) {
+        cur_file_info.set_replaygain(p_info.get_replaygain());
+        source_info_writer_->set_info(0, cur_file_info, p_abort);
+        // committed together with the meta below
+        ncm_file_->stage_embedded([writer = source_info_writer_](abort_callback &p_abort) { writer->commit(p_abort); });
+    }
 
     // Meta tags
     // NOTE: Always do differential update, to maximally avoid appending "overwrite" key,
     // which will change the "163 key xxxx" content.
-    auto target_json = meta_processor(p_info).dump();
-    if (target_json.empty()) { // fallback case: clear all fields
+    const auto target = meta_processor(p_info);
+    if (static_cast<const uniform_meta_st &>(target) == uniform_meta_st{}) { // fallback case: clear all fields
         return this->remove_tags(p_abort);
     }
-    this->get_info(cur_file_info, p_abort);
-    auto current_json = meta_processor(cur_file_info).dump();
+    if (!ncm_file_->meta_parsed()) {
+        ncm_file_->parse(ncm_file::parse_targets::NCM_PARSE_META);
+    }
+    // what get_info() reports: source info + ncm meta, the source info is already at hand
+    auto current = meta_processor(cur_file_info);
+    current.update(ncm_file_->meta_info());
 
     auto overwrite = json_t::object();
-
     if (ncm_file_->meta_info().contains(overwrite_key)) {
-        // overwrite is guaranteed to be suitable with current_meta
-        // because this->get_info() will call parse() and reset meta_info()
         overwrite = ncm_file_->meta_info()[overwrite_key];
     }
-
-    auto diff = json_t::diff(current_json, target_json);
-    auto to_merge = json_t::object();
-    for (const auto &op : diff) {
-        json_t::json_pointer pt(op["path"]);
-        for (; !pt.parent_pointer().empty(); pt = pt.parent_pointer()) {
-            continue;
-        }
-        if (op["op"] == "remove") {
-            if (!overwrite.contains(pt.back())) {
-                overwrite.emplace(pt.back(), nullptr);
-            } else {
-                overwrite[pt.back()] = nullptr;
-            }
-        } else {
-            if (overwrite.contains(pt.back())) {
-                overwrite.erase(pt.back());
-            }
-            overwrite.emplace(pt.back(), target_json.at(pt)); // copy the top level
-        }
+    for (const auto &[key, val] : current.diff(target).items()) {
+        overwrite[key] = val; // replace the top level
     }
 
-    overwrite.merge_patch(to_merge);
-
-    ncm_file_->overwrite_meta(overwrite, p_abort);
+    ncm_file_->stage_meta(overwrite);
+    if (!ncm_file_->commit_edits(p_abort)) {
+        ++g_retag_skipped;
+    }
 }
 
 /// @brief "Clear tags" => restore the meta field (163 key) to its original state
@@ -91,9 +97,45 @@ void fb2k_ncm::input_ncm::retag(const file_info &p_info, abort_callback &p_abort
 void fb2k_ncm::input_ncm::remove_tags(abort_callback &p_abort) {
     DEBUG_LOG("input_ncm::remove_tags()");
     // source_info_writer_->remove_tags_fallback(p_abort);
-    ncm_file_->overwrite_meta(nlohmann::json(), p_abort);
+    if (!ncm_file_->overwrite_meta(nlohmann::json(), p_abort)) {
+        ++g_retag_skipped;
+    }
 }
 
+namespace
+{
+    enum class content_type { flac, mpeg, any /* mpeg + flac */ };
+
+    /// @note Input services are all registered at startup, so each lookup is done only once,
+    /// instead of enumerating the services every time a file is opened (which is a lot during library scanning).
+    const service_list_t<input_entry> &find_inputs_by_content_type(content_type type) {
+        static const auto flac = [] {
+            service_list_t<input_entry> l;
+            input_entry::g_find_inputs_by_content_type(l, "audio/flac", true);
+            return l;
+        }();
+        static const auto mpeg = [] {
+            service_list_t<input_entry> l;
+            input_entry::g_find_inputs_by_content_type(l, "audio/mpeg", true);
+            return l;
+        }();
+        static const auto any = [] {
+            service_list_t<input_entry> l;
+            l.add_items(mpeg);
+            l.add_items(flac);
+            return l;
+        }();
+        switch (type) {
+        case content_type::flac:
+            return flac;
+        case content_type::mpeg:
+            return mpeg;
+        default:
+            return any;
+        }
+    }
+} // namespace
+
 inline bool fb2k_ncm::input_ncm::decode_can_seek() {
     return decoder_->can_seek();
 }
@@ -131,41 +173,50 @@ void input_ncm::open(foobar2000_io::file::ptr p_filehint, const char *p_path, t_
 
     // walk through the file structure
     // parse() won't decrypt the whole file, so we can always parse metadata and audio info at the same time.
-    if (!(ncm_file_->meta_parsed() && ncm_file_->audio_key_parsed())) {
-        ncm_file_->parse(ncm_file::parse_targets::NCM_PARSE_META | ncm_file::parse_targets::NCM_PARSE_AUDIO);
+    // NOTE: Except for pure playback, where decrypting the meta block (base64 + AES + JSON) is wasted work.
+    // The rc4 key is all we need to start decoding, meta info is parsed lazily by get_info() / retag().
+    const bool decode_only = p_reason == t_input_open_reason::input_open_decode;
+    if (!ncm_file_->audio_key_parsed() || (!decode_only && !ncm_file_->meta_parsed())) {
+        ncm_file_->parse(decode_only ? ncm_file::parse_targets::NCM_PARSE_AUDIO
+                                     : ncm_file::parse_targets::NCM_PARSE_META | ncm_file::parse_targets::NCM_PARSE_AUDIO);
     }
 
     // find any available decoders by the following steps:
-    // 1. check if there is a format hint in meta_info
+    // 1. check if there is a format hint in meta_info, or sniff it from the audio head if meta is not parsed
     // 2. select the 2 possible decoder (mp3,flac) and try if any of them works
     // 3. enumerate all input_entry and test if one accepts the audio content
-    service_list_t<input_entry> input_services;
+    const service_list_t<input_entry> *input_services = nullptr;
     do {
+        std::string format_hint;
+        if (ncm_file_->meta_parsed()) {
+            if (ncm_file_->meta_info().is_object() && ncm_file_->meta_info().contains("format") &&
+                ncm_file_->meta_info()["format"].is_string()) {
+                format_hint = ncm_file_->meta_info()["format"].get<std::string>();
+            }
+        } else {
+            format_hint = ncm_file_->sniff_audio_format(p_abort);
+        }
         // there is format hint, so we don't have to find_input twice or more
-        if (ncm_file_->meta_info().is_object() && ncm_file_->meta_info().contains("format")) {
-            if (ncm_file_->meta_info()["format"] == "flac") {
-                input_entry::g_find_inputs_by_content_type(input_services, "audio/flac", true);
+        if (!format_hint.empty()) {
+            if (format_hint == "flac") {
+                input_services = &find_inputs_by_content_type(content_type::flac);
                 break;
-            } else if (ncm_file_->meta_info()["format"] == "mp3") {
-                input_entry::g_find_inputs_by_content_type(input_services, "audio/mpeg", true);
+            } else if (format_hint == "mp3") {
+                input_services = &find_inputs_by_content_type(content_type::mpeg);
                 break;
             } else {
-                ERROR_LOG("Unknown ncm format hint: ", ncm_file_->meta_info()["format"].get_ref<const nlohmann::json::string_t &>());
+                ERROR_LOG("Unknown ncm format hint: ", format_hint);
                 throw exception_io_unsupported_format();
             }
         }
         // unable to determine decoder directly,  guess possible
-        service_list_t<input_entry> mpeg_decoders, flac_decoders;
-        input_entry::g_find_inputs_by_content_type(mpeg_decoders, "audio/mpeg", true);
-        input_entry::g_find_inputs_by_content_type(flac_decoders, "audio/flac", true);
-        input_services.add_items(mpeg_decoders);
-        input_services.add_items(flac_decoders);
+        input_services = &find_inputs_by_content_type(content_type::any);
     } while (false);
 
     service_ptr_t<input_entry_v2> input_ptr;
     // see if found input matches the codec
-    for (size_t i = 0; i < input_services.get_count(); ++i) {
-        input_services[i]->cast(input_ptr);
+    for (size_t i = 0; i < input_services->get_count(); ++i) {
+        (*input_services)[i]->cast(input_ptr);
         try {
             if (input_ptr.is_valid()) {
                 input_ptr->open_for_decoding(decoder_, ncm_file_, /*file_path_*/ "", p_abort);
@@ -251,8 +302,10 @@ void input_ncm::get_info(file_info &p_info, abort_callback &p_abort) {
         return;
     }
 
-    // refresh meta info after retagging
-    ncm_file_->parse(ncm_file::parse_targets::NCM_PARSE_META);
+    // opens for decoding skip the meta, retagging invalidates the header, so only parse when there is none
+    if (!ncm_file_->meta_parsed()) {
+        ncm_file_->parse(ncm_file::parse_targets::NCM_PARSE_META);
+    }
 
     input_info_reader::ptr reader;
     if (source_info_writer_.is_valid()) { // if just retagged, use the recent file_info
@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include "meta_process.hpp"
 #include "common/helpers.hpp"
+#include "common/extra_fields.hpp"
 
 #include <functional>
 
@@ -14,60 +15,69 @@ using json_t = nlohmann::json;
     case 1:
 
 void meta_processor::update(const file_info &info) { // FB2K
-    using refl_f_t = void(t_size /*enum index*/);
-    auto reflection = std::unordered_map<std::string, std::function<refl_f_t>>{}; // UPPERCASE keys
-    reflection["artist"_upper] = [&](t_size meta_entry) {
-        auto vc = info.meta_enum_value_count(meta_entry);
-        if (!vc) {
-            return;
-        }
-        if (!artist.has_value()) {
-            artist.emplace();
-        }
-        for (auto i = 0; i < vc; ++i) {
-            artist->emplace(info.meta_enum_value(meta_entry, i), 0 /*artist id, default to 0*/);
-        }
-    };
-#define reflect_single(field) [&](t_size meta_entry) { update_v(field, info.meta_enum_value(meta_entry, 0)); }
-#define reflect_multi(field)                                      \
-    [&](t_size meta_entry) {                                      \
-        auto vc = info.meta_enum_value_count(meta_entry);         \
-        for (auto i = 0; i < vc; ++i) {                           \
-            update_v(field, info.meta_enum_value(meta_entry, i)); \
-        }                                                         \
+    // NOTE: The table is built once and shared by all threads (library scanning runs on several of them).
+    // Handlers are plain function pointers, so looking up a field never allocates.
+    using refl_f_t = void(meta_processor & /*self*/, const file_info &, t_size /*enum index*/);
+    static const auto reflection = [] {
+        auto r = std::unordered_map<std::string, refl_f_t *>{}; // UPPERCASE keys
+        r["artist"_upper] = [](meta_processor &self, const file_info &info, t_size meta_entry) {
+            auto vc = info.meta_enum_value_count(meta_entry);
+            if (!vc) {
+                return;
+            }
+            if (!self.artist.has_value()) {
+                self.artist.emplace();
+            }
+            for (auto i = 0; i < vc; ++i) {
+                self.artist->emplace(info.meta_enum_value(meta_entry, i), 0 /*artist id, default to 0*/);
+            }
+        };
+#define reflect_single(field) \
+    [](meta_processor &self, const file_info &info, t_size meta_entry) { update_v(self.field, info.meta_enum_value(meta_entry, 0)); }
+#define reflect_multi(field)                                             \
+    [](meta_processor &self, const file_info &info, t_size meta_entry) { \
+        auto vc = info.meta_enum_value_count(meta_entry);                \
+        for (auto i = 0; i < vc; ++i) {                                  \
+            update_v(self.field, info.meta_enum_value(meta_entry, i));   \
+        }                                                                \
     }
 
-    // fb2k
-    reflection["Title"_upper] = reflect_single(title);
-    reflection["Album"_upper] = reflect_single(album);
-    reflection["Date"_upper] = reflect_single(date);
-    reflection["Genre"_upper] = reflect_multi(genre);
-    reflection["Producer"_upper] = reflect_multi(producer);
-    reflection["Composer"_upper] = reflect_multi(composer);
-    reflection["Performer"_upper] = reflect_multi(performer);
-    reflection["Album Artist"_upper] = reflect_multi(album_artist);
-    reflection["TrackNumber"_upper] = reflect_single(track_number);
-    reflection["TotalTracks"_upper] = reflect_single(total_tracks);
-    reflection["DiscNumber"_upper] = reflect_single(disc_number);
-    reflection["TotalDiscs"_upper] = reflect_single(total_discs);
-    reflection["Comment"_upper] = reflect_single(comment);
-    reflection["Lyrics"_upper] = reflect_single(lyrics);
-
-    // ncm
-    reflection["alias"_upper] = reflect_multi(alias);
-    reflection["transNames"_upper] = reflect_multi(transNames);
-
-    // ignore essential special keys
-    reflection[foo_input_ncm_comment_key.data()] = [](auto...) {};
-    reflection[upper(foo_input_ncm_comment_key)] = [](auto...) {};
-    reflection[overwrite_key.data()] = [](auto...) {};
-    reflection[upper(overwrite_key)] = [](auto...) {};
+        // fb2k
+        r["Title"_upper] = reflect_single(title);
+        r["Album"_upper] = reflect_single(album);
+        r["Date"_upper] = reflect_single(date);
+        r["Genre"_upper] = reflect_multi(genre);
+        r["Producer"_upper] = reflect_multi(producer);
+        r["Composer"_upper] = reflect_multi(composer);
+        r["Performer"_upper] = reflect_multi(performer);
+        r["Album Artist"_upper] = reflect_multi(album_artist);
+        r["TrackNumber"_upper] = reflect_single(track_number);
+        r["TotalTracks"_upper] = reflect_single(total_tracks);
+        r["DiscNumber"_upper] = reflect_single(disc_number);
+        r["TotalDiscs"_upper] = reflect_single(total_discs);
+        r["Comment"_upper] = reflect_single(comment);
+        r["Lyrics"_upper] = reflect_single(lyrics);
+
+        // ncm
+        r["alias"_upper] = reflect_multi(alias);
+        r["transNames"_upper] = reflect_multi(transNames);
+
+        // ignore essential special keys
+        constexpr refl_f_t *ignore = [](meta_processor &, const file_info &, t_size) {};
+        r[foo_input_ncm_comment_key.data()] = ignore;
+        r[upper(foo_input_ncm_comment_key)] = ignore;
+        r[overwrite_key.data()] = ignore;
+        r[upper(overwrite_key)] = ignore;
+#undef reflect_single
+#undef reflect_multi
+        return r;
+    }();
 
     auto meta_count = info.meta_get_count();
     for (auto i = 0; i < meta_count; ++i) {
         auto name = upper(info.meta_enum_name(i));
-        if (reflection.contains(name)) {
-            std::invoke(reflection[name], i);
+        if (auto it = reflection.find(name); it != reflection.end()) {
+            std::invoke(it->second, *this, info, i);
         } else {
             auto vc = info.meta_enum_value_count(i);
             if (vc == 1) {
@@ -79,8 +89,6 @@ void meta_processor::update(const file_info &info) { // FB2K
             }
         }
     }
-#undef reflect_single
-#undef reflect_multi
 }
 
 void meta_processor::update(const nlohmann::json &json) { // NCM, public
@@ -100,108 +108,115 @@ void meta_processor::update_by_json(const nlohmann::json &json, bool overwriting
         return;
     }
 
-    using refl_f_t = void(const nlohmann::json &);
-    auto reflection = std::unordered_map<std::string, std::function<refl_f_t>>{}; // UPPERCASE keys
-    reflection["artist"] = [&](const json_t &j) {
-        if (j.is_null()) {
-            artist.reset();
-            return;
-        }
-        if (!artist.has_value()) {
-            artist.emplace();
-        } else if (overwriting) {
-            artist.reset();
-            artist.emplace();
-        }
-        for (const auto &val : j.get_ref<const json_t::array_t &>()) {
-            if (val.size() != 2) {
-                continue;
+    // NOTE: built once and shared, see update(const file_info &)
+    using refl_f_t = void(meta_processor & /*self*/, const nlohmann::json &, bool /*overwriting*/);
+    static const auto reflection = [] {
+        auto r = std::unordered_map<std::string, refl_f_t *>{};
+        r["artist"] = [](meta_processor &self, const json_t &j, bool overwriting) {
+            if (j.is_null()) {
+                self.artist.reset();
+                return;
             }
-            if (!val[0].is_string() /*|| !val[1].is_number_integer()*/) { // ARTIST ID can be str or num
-                continue;
+            if (!self.artist.has_value()) {
+                self.artist.emplace();
+            } else if (overwriting) {
+                self.artist.reset();
+                self.artist.emplace();
             }
-            artist->emplace(val[0].get<std::string>(), weak_typed_id(val[1]));
-        }
-    };
-
-    // NOTE: I found an abnormal case that albumPicId is a number instead of string.
-    // So I deside to test every possible numeric type and try to convert them.
-
-#define reflect_single(field, TYPE)                \
-    [&](const json_t &j) {                         \
-        if (j.is_null()) {                         \
-            field.reset();                         \
-            return;                                \
-        }                                          \
-        try {                                      \
-            update_v(field, j.get<TYPE>());        \
-        } catch (const json_t::type_error &) {     \
-            try {                                  \
-                update_v(field, weak_typed_id(j)); \
-            } catch (const json_t::type_error &) { \
-            }                                      \
-        }                                          \
+            for (const auto &val : j.get_ref<const json_t::array_t &>()) {
+                if (val.size() != 2) {
+                    continue;
+                }
+                if (!val[0].is_string() /*|| !val[1].is_number_integer()*/) { // ARTIST ID can be str or num
+                    continue;
+                }
+                self.artist->emplace(val[0].get<std::string>(), weak_typed_id(val[1]));
+            }
+        };
+
+        // NOTE: I found an abnormal case that albumPicId is a number instead of string.
+        // So I deside to test every possible numeric type and try to convert them.
+
+#define reflect_single(field, TYPE)                     \
+    [](meta_processor &self, const json_t &j, bool) {   \
+        if (j.is_null()) {                              \
+            self.field.reset();                         \
+            return;                                     \
+        }                                               \
+        try {                                           \
+            update_v(self.field, j.get<TYPE>());        \
+        } catch (const json_t::type_error &) {          \
+            try {                                       \
+                update_v(self.field, weak_typed_id(j)); \
+            } catch (const json_t::type_error &) {      \
+            }                                           \
+        }                                               \
     }
 #define reflect_multi_string(field)                                    \
-    [&](const json_t &j) {                                             \
+    [](meta_processor &self, const json_t &j, bool overwriting) {      \
         if (j.is_null()) {                                             \
-            field.reset();                                             \
+            self.field.reset();                                        \
             return;                                                    \
         }                                                              \
         if (!j.is_array()) {                                           \
             return;                                                    \
         }                                                              \
-        if (overwriting && field.has_value()) {                        \
-            field.reset();                                             \
-            field.emplace();                                           \
+        if (overwriting && self.field.has_value()) {                   \
+            self.field.reset();                                        \
+            self.field.emplace();                                      \
         }                                                              \
         for (const auto &val : j.get_ref<const json_t::array_t &>()) { \
             if (!val.is_string()) {                                    \
                 continue;                                              \
             }                                                          \
-            update_v(field, val.get<std::string>());                   \
+            update_v(self.field, val.get<std::string>());              \
         }                                                              \
     }
 
-    // NCM fields
-    reflection["musicId"] = reflect_single(musicId, uint64_t);
-    reflection["musicName"] = reflect_single(title, std::string);
-    reflection["albumId"] = reflect_single(albumId, uint64_t);
-    reflection["album"] = reflect_single(album, std::string);
-    reflection["albumPicDocId"] = reflect_single(albumPicDocId, std::string);
-    reflection["albumPic"] = reflect_single(albumPic, std::string);
-    reflection["mp3DocId"] = reflect_single(mp3DocId, std::string);
-    reflection["mvId"] = reflect_single(mvId, uint64_t);
-    reflection["bitrate"] = reflect_single(bitrate, uint64_t);
-    reflection["duration"] = reflect_single(duration, uint64_t);
-    reflection["format"] = reflect_single(format, std::string);
-    reflection["alias"] = reflect_multi_string(alias);
-    reflection["transNames"] = reflect_multi_string(transNames);
-
-    // FB2K fields, UPPERCASE
-    reflection["title"_upper] = reflect_single(title, std::string); // maybe overwrite
-    reflection["album"_upper] = reflect_single(album, std::string); // maybe overwrite
-    reflection["date"_upper] = reflect_single(date, std::string);
-    reflection["genre"_upper] = reflect_multi_string(genre);
-    reflection["producer"_upper] = reflect_multi_string(producer);
-    reflection["composer"_upper] = reflect_multi_string(composer);
-    reflection["performer"_upper] = reflect_multi_string(performer);
-    reflection["album artist"_upper] = reflect_multi_string(album_artist);
-    reflection["TrackNumber"_upper] = reflect_single(track_number, std::string);
-    reflection["TotalTracks"_upper] = reflect_single(total_tracks, std::string);
-    reflection["DiscNumber"_upper] = reflect_single(disc_number, std::string);
-    reflection["TotalDiscs"_upper] = reflect_single(total_discs, std::string);
-    reflection["Comment"_upper] = reflect_single(comment, std::string);
-    reflection["Lyrics"_upper] = reflect_single(lyrics, std::string);
-
-    // ignore comment key
-    reflection[foo_input_ncm_comment_key.data()] = [](auto...) { /* DO NOTHING*/ };
-    // ignore overwrite currently
-    reflection[overwrite_key.data()] = [](auto...) {};
+        // NCM fields
+        r["musicId"] = reflect_single(musicId, uint64_t);
+        r["musicName"] = reflect_single(title, std::string);
+        r["albumId"] = reflect_single(albumId, uint64_t);
+        r["album"] = reflect_single(album, std::string);
+        r["albumPicDocId"] = reflect_single(albumPicDocId, std::string);
+        r["albumPic"] = reflect_single(albumPic, std::string);
+        r["mp3DocId"] = reflect_single(mp3DocId, std::string);
+        r["mvId"] = reflect_single(mvId, uint64_t);
+        r["bitrate"] = reflect_single(bitrate, uint64_t);
+        r["duration"] = reflect_single(duration, uint64_t);
+        r["format"] = reflect_single(format, std::string);
+        r["alias"] = reflect_multi_string(alias);
+        r["transNames"] = reflect_multi_string(transNames);
+
+        // FB2K fields, UPPERCASE
+        r["title"_upper] = reflect_single(title, std::string); // maybe overwrite
+        r["album"_upper] = reflect_single(album, std::string); // maybe overwrite
+        r["date"_upper] = reflect_single(date, std::string);
+        r["genre"_upper] = reflect_multi_string(genre);
+        r["producer"_upper] = reflect_multi_string(producer);
+        r["composer"_upper] = reflect_multi_string(composer);
+        r["performer"_upper] = reflect_multi_string(performer);
+        r["album artist"_upper] = reflect_multi_string(album_artist);
+        r["TrackNumber"_upper] = reflect_single(track_number, std::string);
+        r["TotalTracks"_upper] = reflect_single(total_tracks, std::string);
+        r["DiscNumber"_upper] = reflect_single(disc_number, std::string);
+        r["TotalDiscs"_upper] = reflect_single(total_discs, std::string);
+        r["Comment"_upper] = reflect_single(comment, std::string);
+        r["Lyrics"_upper] = reflect_single(lyrics, std::string);
+
+        // ignore comment key
+        r[foo_input_ncm_comment_key.data()] = [](meta_processor &, const json_t &, bool) { /* DO NOTHING*/ };
+        // ignore overwrite currently
+        r[overwrite_key.data()] = [](meta_processor &, const json_t &, bool) {};
+
+#undef reflect_single
+#undef reflect_multi_string
+        return r;
+    }();
 
     for (const auto &[key, val] : json.items()) {
-        if (reflection.contains(key)) {
-            std::invoke(reflection[key], val);
+        if (auto it = reflection.find(key); it != reflection.end()) {
+            std::invoke(it->second, *this, val, overwriting);
         } else {
             if (val.is_string()) {
                 extra_single_values[key] = val.get<std::string>();
@@ -218,9 +233,6 @@ void meta_processor::update_by_json(const nlohmann::json &json, bool overwriting
             }
         }
     }
-
-#undef reflect_single
-#undef reflect_multi_string
 }
 
 void meta_processor::apply(file_info &info) { // FB2K
@@ -379,3 +391,77 @@ json_t meta_processor::dump() { // NCM
 #undef dump_multi
 #undef dump_multi2
 }
+
+/// @brief Top-level members of the `overwrite` object that change `this` into `target`, named as dump() does. `null` for removed fields.
+/// @note
+/// - Compared field by field, no json document is built for either side.
+/// - `this` is expected to be built from the source info + ncm meta (as get_info() does), `target` from a file_info.
+/// Only fields that can be edited through file_info are compared. Info fields (musicId, format...) are immutable,
+/// artist ids are lost in file_info, so they're ignored as well. Extra fields are compared by extra_fields::diff().
+json_t meta_processor::diff(const meta_processor &target) const {
+    auto overwrite = json_t::object();
+    if (static_cast<const uniform_meta_st &>(*this) == target) {
+        return overwrite;
+    }
+
+    auto artist_names = [](const meta_processor &m) {
+        multi<> names;
+        if (m.artist.has_value()) {
+            for (const auto &[name, id] : *m.artist) {
+                names.emplace(name);
+            }
+        }
+        return names;
+    };
+    if (artist.has_value() != target.artist.has_value() || artist_names(*this) != artist_names(target)) {
+        if (target.artist.has_value()) {
+            overwrite["artist"] = json_t::array();
+            for (const auto &[name, id] : *target.artist) {
+                overwrite["artist"].emplace_back(json_t::array({name, id}));
+            }
+        } else {
+            overwrite["artist"] = nullptr;
+        }
+    }
+
+#define diff_field2(name, field)                                                       \
+    if (field != target.field) {                                                       \
+        overwrite[name] = target.field.has_value() ? json_t(*target.field) : json_t(); \
+    }
+#define diff_field(field) diff_field2(#field, field)
+#define diff_field_u(field) diff_field2(#field##_upper, field)
+
+    // same names as dump()
+    diff_field_u(title);
+    diff_field2("musicName", title);
+    diff_field(album);
+    diff_field_u(date);
+    diff_field_u(genre);
+    diff_field_u(producer);
+    diff_field_u(composer);
+    diff_field_u(performer);
+    diff_field2("Album Artist"_upper, album_artist);
+    diff_field2("TrackNumber"_upper, track_number);
+    diff_field2("TotalTracks"_upper, total_tracks);
+    diff_field2("DiscNumber"_upper, disc_number);
+    diff_field2("TotalDiscs"_upper, total_discs);
+    diff_field(comment);
+    diff_field(lyrics);
+    diff_field(alias);
+    diff_field(transNames);
+
+#undef diff_field
+#undef diff_field_u
+#undef diff_field2
+
+    for (auto &&[name, vals] : extra_fields::diff(extra_single_values, extra_multi_values, target.extra_single_values, target.extra_multi_values)) {
+        if (!vals.has_value()) {
+            overwrite[name] = nullptr;
+        } else if (vals->size() == 1) {
+            overwrite[name] = *vals->begin();
+        } else {
+            overwrite[name] = json_t(*vals);
+        }
+    }
+    return overwrite;
+}
@@ -90,6 +90,7 @@ namespace fb2k_ncm
         void update(const nlohmann::json &json); // NCM
         void apply(file_info &info);             // FB2K
         nlohmann::json dump();                   // NCM
+        nlohmann::json diff(const meta_processor &target) const; // NCM, members of `overwrite`
         explicit meta_processor(const file_info &info) { update(info); }
         explicit meta_processor(const nlohmann::json &json) { update(json); }
 
@@ -3,16 +3,279 @@
 
 #include "common/platform.hpp"
 #include "meta_process.hpp"
+#include "config.hpp"
+#include "extraction_manifest.hpp"
+#include "common/tag_builder.hpp"
+#include "cipher/meta_codec.hpp"
 #include "common/log.hpp"
+#include "common/bounded_queue.hpp"
+#include "common/worker_pool.hpp"
+#include "common/mapped_output.hpp"
+#include "common/uncached_file.hpp"
+#include "common/io_governor.hpp"
 
 #include <algorithm>
+#include <array>
 #include <span>
 #include <ranges>
 #include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <utility>
+#include <cstring>
 
 using namespace std::string_view_literals;
 using namespace fb2k_ncm;
 
+namespace
+{
+    /// @brief Process-wide cache of parsed headers, keyed by canonical path and file timestamp.
+    /// @note A modified file gets a new timestamp, so stale entries are never handed out.
+    /// Writers still invalidate explicitly, because timestamps of some filesystems are too coarse.
+    class ncm_file_registry {
+        struct entry_st {
+            t_filetimestamp timestamp = filetimestamp_invalid;
+            ncm_file::header_ptr header;
+            uint64_t last_used = 0;
+        };
+
+    public:
+        static ncm_file_registry &instance() {
+            static ncm_file_registry registry;
+            return registry;
+        }
+
+        ncm_file::header_ptr lookup(const char *path, t_filetimestamp timestamp) {
+            if (timestamp == filetimestamp_invalid) {
+                return nullptr;
+            }
+            std::lock_guard lock(mutex_);
+            auto it = entries_.find(path);
+            if (it == entries_.end() || it->second.timestamp != timestamp) {
+                return nullptr;
+            }
+            it->second.last_used = ++tick_;
+            return it->second.header;
+        }
+
+        void store(const char *path, t_filetimestamp timestamp, ncm_file::header_ptr header) {
+            if (timestamp == filetimestamp_invalid) {
+                return;
+            }
+            std::lock_guard lock(mutex_);
+            auto &entry = entries_[path];
+            total_size_ -= size_of(entry.header);
+            entry = {timestamp, std::move(header), ++tick_};
+            total_size_ += size_of(entry.header);
+            evict();
+        }
+
+        void invalidate(const char *path) {
+            std::lock_guard lock(mutex_);
+            if (auto it = entries_.find(path); it != entries_.end()) {
+                total_size_ -= size_of(it->second.header);
+                entries_.erase(it);
+            }
+        }
+
+    private:
+        static uint64_t size_of(const ncm_file::header_ptr &header) {
+            return header ? header->meta_str.size() + header->album_image_data.size() : 0;
+        }
+
+        // drop the least recently used ones, consumers holding them are not affected
+        void evict() {
+            while (entries_.size() > max_shared_headers || (total_size_ > max_shared_headers_size && entries_.size() > 1)) {
+                auto lru = std::min_element(
+                    entries_.begin(), entries_.end(), [](const auto &a, const auto &b) { return a.second.last_used < b.second.last_used; });
+                total_size_ -= size_of(lru->second.header);
+                entries_.erase(lru);
+            }
+        }
+
+    private:
+        std::mutex mutex_;
+        std::unordered_map<std::string, entry_st> entries_;
+        uint64_t total_size_ = 0;
+        uint64_t tick_ = 0;
+    };
+
+    /// @brief Codec of the meta field, the length prefix is handled here.
+    const cipher::meta_codec &meta_field_codec() {
+        static const cipher::meta_codec codec{ncm_meta_aes_key, meta_b64_hint};
+        return codec;
+    }
+
+    /// @brief Where a member of a top-level JSON object is, found by scanning the text instead of parsing it into a DOM.
+    struct json_member_scan_st {
+        bool valid = false;        // text is a (syntactically balanced) object
+        bool empty = true;         // the object has no members
+        size_t close = 0;          // position of the closing '}'
+        bool found = false;        // the member exists
+        size_t sep = 0;            // '{' or ',' before the member
+        size_t term = 0;           // '}' or ',' after the member
+        size_t value_begin = 0;    // [value_begin, value_end) is the value text, whitespaces excluded
+        size_t value_end = 0;
+    };
+
+    json_member_scan_st scan_json_member(std::string_view text, std::string_view key) {
+        constexpr auto ws = " \t\r\n"sv;
+        json_member_scan_st r;
+        size_t i = text.find_first_not_of(ws);
+        if (i == std::string_view::npos || text[i] != '{') {
+            return r;
+        }
+        int depth = 0;
+        bool in_str = false, expecting_key = false, matched = false;
+        size_t sep = i, key_begin = 0;
+        for (; i < text.size(); ++i) {
+            const char c = text[i];
+            if (in_str) {
+                if (c == '\\') {
+                    ++i;
+                } else if (c == '"') {
+                    in_str = false;
+                    if (depth == 1 && key_begin) {
+                        matched = text.substr(key_begin, i - key_begin) == key;
+                        key_begin = 0;
+                    }
+                }
+                continue;
+            }
+            switch (c) {
+            case '"':
+                in_str = true;
+                if (depth == 1 && expecting_key) {
+                    expecting_key = false;
+                    key_begin = i + 1;
+                    r.empty = false;
+                }
+                break;
+            case ':':
+                if (depth == 1 && matched) {
+                    r.value_begin = text.find_first_not_of(ws, i + 1);
+                }
+                break;
+            case '{':
+            case '[':
+                if (++depth == 1) {
+                    expecting_key = true;
+                }
+                break;
+            case '}':
+            case ']':
+            case ',':
+                if (depth == 1 && (c == ',' || c == '}') && matched) {
+                    r.found = true;
+                    r.sep = sep;
+                    r.term = i;
+                    r.value_end = text.find_last_not_of(ws, i - 1) + 1;
+                    matched = false;
+                }
+                if (c == ',') {
+                    if (depth == 1) {
+                        sep = i;
+                        expecting_key = true;
+                    }
+                } else if (--depth == 0) {
+                    r.close = i;
+                    r.valid = c == '}';
+                    return r;
+                }
+                break;
+            }
+        }
+        return r; // unterminated
+    }
+} // namespace
+
+namespace
+{
+    bool output_exists(const char *path, uint64_t size, abort_callback &p_abort) {
+        try {
+            t_filestats stats;
+            bool writable = false;
+            filesystem::g_get_stats(path, stats, writable, p_abort);
+            return stats.m_size == size;
+        } catch (const exception_io &) {
+            return false;
+        }
+    }
+
+    /// @return how many leading pieces of the output still match their recorded hashes
+    size_t verified_chunks(const char *output, const std::vector<uint64_t> &chunks, abort_callback &p_abort) {
+        size_t verified = 0;
+        try {
+            file_ptr f;
+            filesystem::g_open_read(f, output, p_abort);
+            std::vector<uint8_t> buffer(extract_chunk_size);
+            for (; verified < chunks.size() && chunks[verified]; ++verified) {
+                chunk_hasher hasher;
+                for (uint64_t left = verify_chunk_size; left;) {
+                    auto n = f->read(buffer.data(), static_cast<size_t>(std::min<uint64_t>(buffer.size(), left)), p_abort);
+                    if (!n) {
+                        break;
+                    }
+                    hasher.update(buffer.data(), n);
+                    left -= n;
+                }
+                if (hasher.digest() != chunks[verified]) {
+                    break;
+                }
+            }
+        } catch (const exception_io &) {
+            // missing or unreadable, verified so far
+        }
+        return verified;
+    }
+
+    /// @brief Meta of `info` as tag_builder takes it. ReplayGain isn't part of the meta in fb2k, it's added as the usual fields.
+    tag_builder::fields_t tag_fields(const file_info &info) {
+        tag_builder::fields_t fields;
+        for (t_size i = 0; i < info.meta_get_count(); ++i) {
+            auto &[name, values] = fields.emplace_back(info.meta_enum_name(i), std::vector<std::string>{});
+            for (t_size j = 0; j < info.meta_enum_value_count(i); ++j) {
+                values.emplace_back(info.meta_enum_value(i, j));
+            }
+        }
+        const auto rg = info.get_replaygain();
+        replaygain_info::t_text_buffer buffer;
+        auto add = [&](const char *name, bool present) {
+            if (present) {
+                fields.emplace_back(name, std::vector<std::string>{buffer});
+            }
+        };
+        add("REPLAYGAIN_TRACK_GAIN", rg.format_track_gain(buffer));
+        add("REPLAYGAIN_TRACK_PEAK", rg.format_track_peak(buffer));
+        add("REPLAYGAIN_ALBUM_GAIN", rg.format_album_gain(buffer));
+        add("REPLAYGAIN_ALBUM_PEAK", rg.format_album_peak(buffer));
+        return fields;
+    }
+} // namespace
+
+void ncm_file::adopt_header(header_ptr header) {
+    parsed_file_ = header->parsed_file;
+    if (header->parsed_targets & parse_targets::NCM_PARSE_AUDIO) {
+        rc4_decryptor_ = header->rc4_decryptor;
+    }
+    header_ = std::move(header);
+}
+
+void ncm_file::track(uint64_t offset, const uint8_t *data, size_t len) {
+    if (tracker_) {
+        tracker_->feed(offset, data, len);
+    }
+}
+
+/// @brief Forget the parsed header after the file has been modified by this instance.
+/// @note Offsets (parsed_file_) and the decryptor are kept, writers are responsible for fixing them.
+void ncm_file::invalidate_header() {
+    ncm_file_registry::instance().invalidate(canonical_path_.c_str());
+    header_ = std::make_shared<parsed_header_st>();
+}
+
 inline void ncm_file::ensure_audio_offset() {
     if (!parsed_file_.audio_content_offset) [[unlikely]] {
         uBugCheck();
@@ -45,6 +308,7 @@ inline void ncm_file::throw_format_error(const std::string &extra) {
 }
 
 auto ncm_file::make_seek_guard(abort_callback &p_abort) {
+    flush_writes(p_abort);
     auto defer =
         [this, &p_abort, p = source_->get_position(p_abort), off = parsed_file_.audio_content_offset, &parsed = parsed_file_](auto...) {
             // RAII guard, will seek back when function returns
@@ -62,46 +326,75 @@ auto ncm_file::make_seek_guard(abort_callback &p_abort) {
 t_size fb2k_ncm::ncm_file::read(void *p_buffer, t_size p_bytes, abort_callback &p_abort) {
     ensure_audio_offset();
     ENSURE_DECRYPTOR();
+    flush_writes(p_abort);
     auto source_pos = source_->get_position(p_abort);
     auto read_offset = source_pos - parsed_file_.audio_content_offset;
-    std::vector<uint8_t> enc(p_bytes);
 
     t_size total = 0;
-    total = source_->read(enc.data(), p_bytes, p_abort);
+    total = source_->read(p_buffer, p_bytes, p_abort);
     if (!total) [[unlikely]] {
         return 0;
     }
 
-    auto dec = rc4_decryptor_.reset_counter(read_offset).transform(enc);
-    std::span<uint8_t> output(static_cast<uint8_t *>(p_buffer), p_bytes);
-    std::copy(std::begin(dec), std::end(dec), std::begin(output));
+    // decrypt in place
+    rc4_decryptor_.apply(static_cast<uint8_t *>(p_buffer), total, read_offset);
     // DEBUG_LOG_F("Read at {} ({}): req={}, real={}", read_offset, source_pos, p_bytes, total);
     return total;
 }
 
 void fb2k_ncm::ncm_file::write(const void *p_buffer, t_size p_bytes, abort_callback &p_abort) {
     ensure_audio_offset();
-    auto source_pos = source_->get_position(p_abort);
+    auto source_pos = write_buffer_.empty() ? source_->get_position(p_abort) : write_buffer_offset_ + write_buffer_.size();
     if (source_pos < parsed_file_.audio_content_offset) {
         ERROR_LOG("Modification (metadata) on a ncm file is not supported.");
         throw exception_io_denied_readonly();
     }
-    auto write_offset = source_pos - parsed_file_.audio_content_offset;
-    std::span<const uint8_t> input(static_cast<const uint8_t *>(p_buffer), p_bytes);
-    auto enc = rc4_decryptor_.reset_counter(write_offset).transform(input);
-    std::vector<uint8_t> buf(enc.begin(), enc.end());
 
-    source_->write(buf.data(), buf.size(), p_abort);
-    // DEBUG_LOG_F("Write to {} ({}): {} bytes", write_offset, source_pos, p_bytes);
+    // NOTE:
+    // Tag writers issue lots of tiny writes (block headers, frames...) next to each other.
+    // They are merged here and encrypted / written at once, see flush_writes().
+    if (!write_buffer_.empty() && write_buffer_.size() + p_bytes > write_buffer_size) {
+        flush_writes(p_abort);
+    }
+    if (write_buffer_.empty()) {
+        write_buffer_offset_ = source_pos;
+        write_buffer_.reserve(write_buffer_size);
+    }
+    auto bytes = static_cast<const uint8_t *>(p_buffer);
+    write_buffer_.insert(write_buffer_.end(), bytes, bytes + p_bytes);
+    if (write_buffer_.size() >= write_buffer_size) {
+        flush_writes(p_abort);
+    }
+}
+
+void fb2k_ncm::ncm_file::flush_writes(abort_callback &p_abort) {
+    if (write_buffer_.empty()) {
+        return;
+    }
+    // encrypted in place, so it must not be retried after a failure
+    auto _clear_guard_ = std::shared_ptr<void>(nullptr, [this](auto...) { write_buffer_.clear(); });
+    // source_ is still at write_buffer_offset_, every other operation flushes before touching it
+    rc4_decryptor_.apply(write_buffer_.data(), write_buffer_.size(), write_buffer_offset_ - parsed_file_.audio_content_offset);
+    source_->write(write_buffer_.data(), write_buffer_.size(), p_abort);
+    // DEBUG_LOG_F("Write to {}: {} bytes", write_buffer_offset_, write_buffer_.size());
+}
+
+fb2k_ncm::ncm_file::~ncm_file() {
+    try {
+        flush_writes(fb2k::noAbort);
+    } catch (const std::exception &e) {
+        ERROR_LOG(e.what(), " (flushing writes to ", path(), ")");
+    }
 }
 
 t_filesize fb2k_ncm::ncm_file::get_size(abort_callback &p_abort) {
     ensure_audio_offset();
+    flush_writes(p_abort);
     return source_->get_size(p_abort) - parsed_file_.audio_content_offset;
 }
 
 t_filesize fb2k_ncm::ncm_file::get_position(abort_callback &p_abort) {
-    auto source_pos = source_->get_position(p_abort);
+    auto source_pos = write_buffer_.empty() ? source_->get_position(p_abort) : write_buffer_offset_ + write_buffer_.size();
     // DEBUG_LOG_F("ncm_file::pos = {} ({})", source_pos - parsed_file_.audio_content_offset, source_pos);
     ensure_audio_offset();
     return source_pos - parsed_file_.audio_content_offset;
@@ -110,12 +403,14 @@ t_filesize fb2k_ncm::ncm_file::get_position(abort_callback &p_abort) {
 void fb2k_ncm::ncm_file::resize(t_filesize p_size, abort_callback &p_abort) {
     // DEBUG_LOG_F("RESIZE ncm_file::resize({})", p_size);
     ensure_audio_offset();
+    flush_writes(p_abort);
     return source_->resize(parsed_file_.audio_content_offset + p_size, p_abort);
 }
 
 void fb2k_ncm::ncm_file::seek(t_filesize p_position, abort_callback &p_abort) {
     // DEBUG_LOG_F("SEEK ncm_file::seek({}) real={}", p_position, parsed_file_.audio_content_offset + p_position);
     ensure_audio_offset();
+    flush_writes(p_abort);
     return source_->seek(parsed_file_.audio_content_offset + p_position, p_abort);
 }
 
@@ -131,6 +426,7 @@ bool fb2k_ncm::ncm_file::get_content_type(pfc::string_base &p_out) {
 void fb2k_ncm::ncm_file::reopen(abort_callback &p_abort) {
     DEBUG_LOG("Reopen: ", this->path());
     ensure_audio_offset();
+    flush_writes(p_abort);
     source_->seek(parsed_file_.audio_content_offset, p_abort);
 }
 
@@ -139,140 +435,331 @@ bool fb2k_ncm::ncm_file::is_remote() {
 }
 
 t_filetimestamp fb2k_ncm::ncm_file::get_timestamp(abort_callback &p_abort) {
+    flush_writes(p_abort);
     return source_->get_timestamp(p_abort);
 }
 
+/// @brief Called by info writers of other inputs when they're done, buffered writes must reach the file (and fail) here.
+void fb2k_ncm::ncm_file::commit(abort_callback &p_abort) {
+    flush_writes(p_abort);
+    source_->commit(p_abort);
+}
+
 void ncm_file::parse(uint16_t to_parse /* = 0xff*/) {
+    if (auto err = try_parse(to_parse); err != parse_error::ok) [[unlikely]] {
+        throw_format_error(describe(err));
+    }
+}
+
+const char *ncm_file::describe(parse_error err) {
+    switch (err) {
+    case parse_error::ok:
+        return "ok";
+    case parse_error::truncated:
+        return "file truncated";
+    case parse_error::magic_mismatch:
+        return "magic number mismatch";
+    case parse_error::rc4_seed_length:
+        return "rc4 key length error";
+    case parse_error::rc4_seed_magic:
+        return "wrong rc4 key magic";
+    case parse_error::meta_hint:
+        return "wrong meta info hint";
+    case parse_error::meta_cipher:
+        return "meta info decryption failed";
+    case parse_error::meta_schema:
+        return "wrong meta info schema";
+    case parse_error::meta_json:
+        return "meta info is not a json object";
+    case parse_error::meta_oversized:
+        return "meta info too large";
+    case parse_error::album_size:
+        return "album image size error";
+    }
+    return "unknown error";
+}
+
+ncm_file::parse_error ncm_file::try_parse(uint16_t to_parse /* = 0xffff*/) {
 
     // NOTE:
     // This is basically a state-driven function.
     // But we don't need an actual state table, because the parsing process is linear.
     // We just do `goto`s to jump to the next state.
 
+    to_parse &= parse_targets::NCM_PARSE_META | parse_targets::NCM_PARSE_ALBUM | parse_targets::NCM_PARSE_AUDIO;
+    auto &p_abort = fb2k::noAbort;
+
+    // the same file is likely being parsed by other services (input, album art, extractor...) around the same time
+    const auto timestamp = source_->get_timestamp(p_abort);
+    auto shared = ncm_file_registry::instance().lookup(canonical_path_.c_str(), timestamp);
+    if (shared && (shared->parsed_targets & to_parse) == to_parse) {
+        adopt_header(std::move(shared));
+        return parse_error::ok;
+    }
+
     DEBUG_LOG_F("Parse (C={}) {}", to_parse, this->path());
 
-    auto &p_abort = fb2k::noAbort;
+    auto header = std::make_shared<parsed_header_st>();
+    auto &h = *header;
     auto _seek_guard_ = make_seek_guard();
     source_->seek_ex(0, file::t_seek_mode::seek_from_beginning, p_abort);
 
+    // NOTE:
+    // Corrupt or foreign files are reported by return value rather than by exceptions,
+    // bulk scans over half-downloaded files would otherwise spend most of their time unwinding.
+    // Only real I/O failures (and aborts) are still thrown by the underlying file.
+    const auto file_size = source_->get_size(p_abort);
+    auto read_exact = [&](void *buf, size_t len) { return source_->read(buf, len, p_abort) == len; };
+    // every length field is untrusted, check it against what's left before allocating or seeking
+    auto fits = [&](uint64_t len) { return file_size == filesize_invalid || len <= file_size - source_->get_position(p_abort); };
+    auto skip = [&](uint64_t len) {
+        if (!fits(len)) {
+            return false;
+        }
+        source_->seek_ex(len, file::t_seek_mode::seek_from_current, p_abort);
+        return true;
+    };
+
     uint64_t magic = 0;
-    source_->read(&magic, sizeof(uint64_t), p_abort);
-    if (magic != parsed_file_.magic) [[unlikely]] {
-        throw_format_error(fmtlib::format("magic number mismatch: {}", magic));
+    if (!read_exact(&magic, sizeof(uint64_t))) [[unlikely]] {
+        return parse_error::truncated;
+    }
+    if (magic != h.parsed_file.magic) [[unlikely]] {
+        return parse_error::magic_mismatch;
     }
 
     // skip gap
-    source_->read(&parsed_file_.unknown_gap_2b, 2, p_abort);
     // extract rc4 key for audio content decoding
-    source_->read(&parsed_file_.rc4_seed_len, sizeof(parsed_file_.rc4_seed_len), p_abort);
-    parsed_file_.rc4_seed_offset = source_->get_position(p_abort);
+    if (!read_exact(&h.parsed_file.unknown_gap_2b, 2) || !read_exact(&h.parsed_file.rc4_seed_len, sizeof(h.parsed_file.rc4_seed_len)))
+        [[unlikely]] {
+        return parse_error::truncated;
+    }
+    h.parsed_file.rc4_seed_offset = source_->get_position(p_abort);
     if (!(to_parse & parse_targets::NCM_PARSE_AUDIO)) {
-        source_->seek_ex(parsed_file_.rc4_seed_len, file::t_seek_mode::seek_from_current, p_abort);
+        if (!skip(h.parsed_file.rc4_seed_len)) [[unlikely]] {
+            return parse_error::truncated;
+        }
         goto STATE_END_AUDIORC4;
     } else {
-        if (0 == parsed_file_.rc4_seed_len || parsed_file_.rc4_seed_len > 256 || (parsed_file_.rc4_seed_len % cipher::AES_BLOCKSIZE))
+        if (0 == h.parsed_file.rc4_seed_len || h.parsed_file.rc4_seed_len > 256 || (h.parsed_file.rc4_seed_len % cipher::AES_BLOCKSIZE))
             [[unlikely]] {
-            throw_format_error("rc4 key length error");
+            return parse_error::rc4_seed_length;
         }
         // NOTE: rc4 key is encrypted by AES
-        auto rc4key_raw = std::make_unique<uint8_t[]>(parsed_file_.rc4_seed_len);
-        source_->read(rc4key_raw.get(), parsed_file_.rc4_seed_len, p_abort);
-        std::for_each_n(rc4key_raw.get(), parsed_file_.rc4_seed_len, [](uint8_t &_b) { _b ^= 0x64; });
+        auto rc4key_raw = std::make_unique<uint8_t[]>(h.parsed_file.rc4_seed_len);
+        if (!read_exact(rc4key_raw.get(), h.parsed_file.rc4_seed_len)) [[unlikely]] {
+            return parse_error::truncated;
+        }
+        std::for_each_n(rc4key_raw.get(), h.parsed_file.rc4_seed_len, [](uint8_t &_b) { _b ^= 0x64; });
         cipher::make_AES_context_with_key(ncm_rc4_seed_aes_key)
             .set_chain_mode(cipher::aes_chain_mode::ECB)
-            .set_input(rc4key_raw.get(), parsed_file_.rc4_seed_len)
-            .set_output(rc4key_raw.get(), parsed_file_.rc4_seed_len)
+            .set_input(rc4key_raw.get(), h.parsed_file.rc4_seed_len)
+            .set_output(rc4key_raw.get(), h.parsed_file.rc4_seed_len)
             .decrypt_all();
         constexpr auto rc4key_magic = "neteasecloudmusic"sv;
         if (memcmp(rc4key_raw.get(), rc4key_magic.data(), rc4key_magic.size())) [[unlikely]] {
-            throw_format_error("wrong rc4 key magic");
+            return parse_error::rc4_seed_magic;
         }
         {
             auto _beg = rc4key_raw.get();
-            auto _end = rc4key_raw.get() + parsed_file_.rc4_seed_len;
+            auto _end = rc4key_raw.get() + h.parsed_file.rc4_seed_len;
             _beg += rc4key_magic.size();
+            // the padding byte is untrusted, guess_padding() would read before the buffer if it's larger than what's left
+            if (const auto padding = *(_end - 1); padding > cipher::AES_BLOCKSIZE || padding > _end - _beg) [[unlikely]] {
+                return parse_error::rc4_seed_magic;
+            }
             _end -= cipher::guess_padding(_end);
-            rc4_decryptor_ = cipher::abnormal_RC4(_beg, _end);
+            h.rc4_decryptor = cipher::abnormal_RC4(_beg, _end);
         }
     }
 STATE_END_AUDIORC4:
     // get meta info json
-    source_->read(&parsed_file_.meta_len, sizeof(parsed_file_.meta_len), p_abort);
-    parsed_file_.meta_offset = source_->get_position(p_abort);
+    if (!read_exact(&h.parsed_file.meta_len, sizeof(h.parsed_file.meta_len))) [[unlikely]] {
+        return parse_error::truncated;
+    }
+    h.parsed_file.meta_offset = source_->get_position(p_abort);
     if (!(to_parse & parse_targets::NCM_PARSE_META)) {
-        source_->seek_ex(parsed_file_.meta_len, file::t_seek_mode::seek_from_current, p_abort);
+        if (!skip(h.parsed_file.meta_len)) [[unlikely]] {
+            return parse_error::truncated;
+        }
         goto STATE_END_META;
     } else {
-        if (0 == parsed_file_.meta_len) [[unlikely]] {
+        if (0 == h.parsed_file.meta_len) [[unlikely]] {
             WARN_LOG("No meta data found in ncm file: ", this->path());
-            meta_str_ = "{}"; // meta_parsed() is determined by the content of meta_str_
-            meta_json_ = json_t::parse(meta_str_.c_str());
+            h.meta_str = "{}";
+            h.meta_json = json_t::parse(h.meta_str.c_str());
             goto STATE_END_META;
         } else {
-            auto meta_b64 = std::make_unique<char[]>(parsed_file_.meta_len + 1);
-            source_->read(meta_b64.get(), parsed_file_.meta_len, p_abort);
-            std::for_each_n(meta_b64.get(), parsed_file_.meta_len, [](auto &b) { b ^= 0x63; });
-            meta_b64[parsed_file_.meta_len] = '\0';
-            if (strncmp(meta_b64.get(), meta_b64_hint.data(), meta_b64_hint.size())) {
-                throw_format_error("wrong meta info hint");
-            }
-            auto meta_decrypt_buffer_size = pfc::base64_decode_estimate(meta_b64.get() + meta_b64_hint.size());
-            auto meta_raw = std::make_unique<uint8_t[]>(meta_decrypt_buffer_size);
-            pfc::base64_decode(meta_b64.get() + meta_b64_hint.size(), meta_raw.get());
-            auto total = cipher::make_AES_context_with_key(ncm_meta_aes_key)
-                             .set_chain_mode(cipher::aes_chain_mode::ECB)
-                             .set_input(meta_raw.get(), meta_decrypt_buffer_size)
-                             .set_output(meta_raw.get(), meta_decrypt_buffer_size)
-                             .decrypt_all()
-                             .outputted_len();
-            total -= cipher::guess_padding(meta_raw.get() + meta_decrypt_buffer_size);
-            meta_raw[total] = '\0';
-            if (memcmp(meta_raw.get(), "music:", 6)) {
-                throw_format_error("wrong meta info schema");
+            if (!fits(h.parsed_file.meta_len)) [[unlikely]] {
+                return parse_error::truncated;
+            }
+            if (h.parsed_file.meta_len > config::max_meta_size()) [[unlikely]] {
+                return parse_error::meta_oversized;
+            }
+            std::vector<uint8_t> meta_field(h.parsed_file.meta_len);
+            if (!read_exact(meta_field.data(), meta_field.size())) [[unlikely]] {
+                return parse_error::truncated;
+            }
+            std::string meta_plain;
+            switch (meta_field_codec().decode(meta_field, meta_plain)) {
+            case cipher::meta_codec::status::ok:
+                break;
+            case cipher::meta_codec::status::hint:
+                return parse_error::meta_hint;
+            default:
+                return parse_error::meta_cipher;
+            }
+            if (!meta_plain.starts_with("music:"sv)) {
+                return parse_error::meta_schema;
             }
             // skip heading `music:`
-            meta_str_.assign(reinterpret_cast<const char *>(&meta_raw[6]), reinterpret_cast<const char *>(&meta_raw[total]));
-            meta_json_ = json_t::parse(meta_str_.c_str());
-            if (!meta_json_.is_object()) {
-                WARN_LOG("Failed to parse meta info of ncm file: ", this->path());
-            } else {
-                // DEBUG_LOG("Parsed NCM Meta: ", meta_json_.dump(2));
-                // overwrite takes effect when get_info() => meta_processor::update()
+            h.meta_str = meta_plain.substr(6);
+            h.meta_json = json_t::parse(h.meta_str, nullptr, false);
+            if (!h.meta_json.is_object()) [[unlikely]] {
+                return parse_error::meta_json;
             }
+            // DEBUG_LOG("Parsed NCM Meta: ", h.meta_json.dump(2));
+            // overwrite takes effect when get_info() => meta_processor::update()
         }
     }
 
 STATE_END_META:
     // skip gap
-    source_->read(&parsed_file_.unknown_gap_5b, sizeof(parsed_file_.unknown_gap_5b), p_abort);
     // get album image
-    source_->read(&parsed_file_.album_image_size, sizeof(parsed_file_.album_image_size), p_abort);
-    parsed_file_.album_image_offset = source_->get_position(p_abort);
+    if (!read_exact(&h.parsed_file.unknown_gap_5b, sizeof(h.parsed_file.unknown_gap_5b)) ||
+        !read_exact(&h.parsed_file.album_image_size, sizeof(h.parsed_file.album_image_size))) [[unlikely]] {
+        return parse_error::truncated;
+    }
+    h.parsed_file.album_image_offset = source_->get_position(p_abort);
     if (!(to_parse & parse_targets::NCM_PARSE_ALBUM)) {
-        source_->seek_ex(parsed_file_.album_image_size[0], file::t_seek_mode::seek_from_current, p_abort);
+        if (!skip(h.parsed_file.album_image_size[0])) [[unlikely]] {
+            return parse_error::truncated;
+        }
         goto STATE_END_ALBUMIMG;
     } else {
-        if (!parsed_file_.album_image_size[0]) {
+        if (!h.parsed_file.album_image_size[0]) {
             WARN_LOG("No album image found in ncm file: ", this->path());
-            album_image_data_.reserve(8); // smallest heap chunk; album_image_parsed() is determined by its capacity
             goto STATE_END_ALBUMIMG;
         }
-        album_image_data_.resize(parsed_file_.album_image_size[1]); // guess: img[0] => total size; img[1] => size_1
-        source_->read(album_image_data_.data(), album_image_data_.size(), p_abort);
+        // guess: img[0] => total size; img[1] => size_1
+        if (h.parsed_file.album_image_size[1] > h.parsed_file.album_image_size[0]) [[unlikely]] {
+            return parse_error::album_size;
+        }
+        if (!fits(h.parsed_file.album_image_size[0])) [[unlikely]] {
+            return parse_error::truncated;
+        }
+        if (h.parsed_file.album_image_size[1] > config::max_album_image_size()) {
+            // too large to be held by the shared header, read_album_image() streams it from the file when asked
+            DEBUG_LOG_F("Album image deferred ({} bytes): {}", h.parsed_file.album_image_size[1], this->path());
+            h.album_image_deferred = true;
+            skip(h.parsed_file.album_image_size[0]);
+            goto STATE_END_ALBUMIMG;
+        }
+        h.album_image_data.resize(h.parsed_file.album_image_size[1]);
+        if (!read_exact(h.album_image_data.data(), h.album_image_data.size())) [[unlikely]] {
+            return parse_error::truncated;
+        }
+        // the region may be larger than the image itself
+        skip(h.parsed_file.album_image_size[0] - h.parsed_file.album_image_size[1]);
     }
 STATE_END_ALBUMIMG:
     // remember where audio content starts
-    parsed_file_.audio_content_offset = source_->get_position(p_abort);
+    h.parsed_file.audio_content_offset = source_->get_position(p_abort);
+
+    // targets parsed earlier (by anyone) are still valid if the file is not modified since then
+    h.parsed_targets = to_parse;
+    if (shared) {
+        if (auto carry = shared->parsed_targets & ~to_parse; carry) {
+            if (carry & parse_targets::NCM_PARSE_META) {
+                h.meta_str = shared->meta_str;
+                h.meta_json = shared->meta_json;
+            }
+            if (carry & parse_targets::NCM_PARSE_ALBUM) {
+                h.album_image_data = shared->album_image_data;
+                h.album_image_deferred = shared->album_image_deferred;
+            }
+            if (carry & parse_targets::NCM_PARSE_AUDIO) {
+                h.rc4_decryptor = shared->rc4_decryptor;
+            }
+            h.parsed_targets |= carry;
+        }
+    }
+    ncm_file_registry::instance().store(canonical_path_.c_str(), timestamp, header);
+    adopt_header(std::move(header));
+    return parse_error::ok;
+}
+
+/// @brief Guess the wrapped format by peeking the decrypted audio head.
+/// @return Same values as the `format` field of the meta info ("flac" / "mp3"), or empty if unrecognized.
+/// @note Only the rc4 key is required, so the meta block doesn't have to be parsed.
+std::string_view ncm_file::sniff_audio_format(abort_callback &p_abort) {
+    ensure_audio_offset();
+    ENSURE_DECRYPTOR();
+    auto _seek_guard_ = make_seek_guard(p_abort);
+
+    uint8_t head[4] = {};
+    this->seek(0, p_abort);
+    if (this->read(head, sizeof(head), p_abort) < sizeof(head)) [[unlikely]] {
+        return {};
+    }
+    if (!memcmp(head, "fLaC", 4)) {
+        return "flac"sv;
+    }
+    if (!memcmp(head, "ID3", 3)) {
+        return "mp3"sv;
+    }
+    if (head[0] == 0xff && (head[1] & 0xe0) == 0xe0) { // bare MPEG frame sync
+        return "mp3"sv;
+    }
+    return {};
+}
+
+album_art_data_ptr ncm_file::read_album_image(abort_callback &p_abort) {
+    if (!album_image_parsed()) {
+        parse(parse_targets::NCM_PARSE_ALBUM);
+    }
+    if (!header_->album_image_deferred) {
+        if (image_data().empty()) {
+            return {};
+        }
+        return album_art_data_impl::g_create(image_data().data(), image_data().size());
+    }
+    // the image isn't encrypted, read it straight into the album art buffer
+    auto _seek_guard_ = make_seek_guard(p_abort);
+    source_->seek(parsed_file_.album_image_offset, p_abort);
+    auto image = fb2k::service_new<album_art_data_impl>();
+    image->from_stream(source_.get_ptr(), parsed_file_.album_image_size[1], p_abort);
+    return image;
+}
+
+/// @brief What the manifest identifies this source by, and where it's extracted to.
+auto ncm_file::manifest_entry(const char *output, uint64_t output_size, abort_callback &p_abort) {
+    extraction_manifest::entry_st entry;
+    entry.source_size = source_->get_size(p_abort);
+    entry.source_timestamp = source_->get_timestamp(p_abort);
+    ensure_audio_offset();
+    chunk_hasher header_hasher;
+    auto header = read_raw(0, parsed_file_.audio_content_offset, p_abort);
+    header_hasher.update(header.data(), header.size());
+    entry.header_hash = header_hasher.digest();
+    entry.output = output;
+    entry.output_size = output_size;
+    return entry;
 }
 
-bool ncm_file::save_raw_audio(const char *to_dir, abort_callback &p_abort) {
+bool ncm_file::save_raw_audio(const char *to_dir, abort_callback &p_abort, extraction_manifest *manifest) {
+    raw_reused_ = false;
     if (!audio_key_parsed() || !meta_parsed()) {
-        parse(parse_targets::NCM_PARSE_AUDIO | parse_targets::NCM_PARSE_META);
+        if (auto err = try_parse(parse_targets::NCM_PARSE_AUDIO | parse_targets::NCM_PARSE_META); err != parse_error::ok) {
+            WARN_LOG("Skipped (", describe(err), "): ", path());
+            path_raw_saved_to_.clear();
+            return false;
+        }
     }
     ENSURE_DECRYPTOR();
     auto ext = [this] {
-        if (bool ok = meta_json_.contains("format"); ok) {
-            const auto &format = meta_json_["format"].get_ref<const nlohmann::json::string_t &>();
+        if (bool ok = meta_info().contains("format"); ok) {
+            const auto &format = meta_info()["format"].get_ref<const nlohmann::json::string_t &>();
             if (format == "flac") {
                 return ".ncm.flac";
             }
@@ -295,13 +782,96 @@ bool ncm_file::save_raw_audio(const char *to_dir, abort_callback &p_abort) {
     // Besides, people usually won't choose the directory containing the songs currently being played as the output directory.
     // To avoid overwriting isn't a good idea either, because the user may want to extract more files to the same directory again,
     // and they likely won't unselect the existing files accurately.
+    std::optional<chunk_tracker> tracker;
+    auto _tracker_guard_ = std::shared_ptr<void>(nullptr, [this](auto...) { tracker_ = nullptr; });
     try {
-        file_ptr file_raw;
-        filesystem::g_open_write_new(file_raw, output, p_abort);
-        this->seek(0, p_abort);
-        if (auto size = file_v2::g_transfer(this, file_raw.get_ptr(), this->get_size(p_abort), p_abort); size == this->get_size(p_abort)) {
+        const auto size = this->get_size(p_abort);
+        const auto split_size = config::split_extraction_size();
+        const bool split = split_size && size >= split_size;
+        uint64_t written = 0;
+
+        // Incremental extraction: skip what's already there, continue what has been interrupted.
+        uint64_t resume_from = 0;
+        if (manifest) {
+            auto current = manifest_entry(output, size, p_abort);
+            current.chunks.assign(static_cast<size_t>((size + verify_chunk_size - 1) / verify_chunk_size), 0);
+
+            if (auto recorded = manifest->find(path()); recorded && recorded->same_source(current)) {
+                if (recorded->complete && output_exists(recorded->output.c_str(), recorded->output_size, p_abort)) {
+                    DEBUG_LOG("Unchanged since the last extraction: ", path());
+                    path_raw_saved_to_ = recorded->output;
+                    raw_reused_ = true;
+                    return true;
+                }
+                if (!recorded->complete && recorded->output == current.output && recorded->chunks.size() == current.chunks.size()) {
+                    auto verified = verified_chunks(output, recorded->chunks, p_abort);
+                    std::copy_n(recorded->chunks.begin(), verified, current.chunks.begin());
+                    resume_from = std::min<uint64_t>(verified * verify_chunk_size, size);
+                    DEBUG_LOG_F("Resuming {} at {} of {} bytes", path(), resume_from, size);
+                }
+            }
+            manifest->update(path(), current);
+            tracker_ = &tracker.emplace(*manifest, path(), size);
+        }
+
+        pfc::string8 native_out, native_in;
+        const bool local = !resume_from && !filesystem::g_is_remote_or_unrecognized(output) &&
+                           foobar2000_io::extract_native_path(output, native_out) && foobar2000_io::extract_native_path(path(), native_in);
+        // Bulk extraction may ask to keep data read once and written once out of the system cache.
+        std::unique_ptr<uncached_file> uncached_in, uncached_out;
+        if (local && config::uncached_extraction()) {
+            if (uncached_in = uncached_file::open_read(native_in); uncached_in) {
+                uncached_out = uncached_file::create(native_out, size);
+            }
+        }
+        // Otherwise local targets are written through a mapping: the source is read straight into the output pages and decrypted there.
+        std::unique_ptr<mapped_output> mapped;
+        if (local && !uncached_out) {
+            mapped = mapped_output::create(native_out, size);
+        }
+
+        if (resume_from) {
+            file_ptr file_raw;
+            filesystem::g_open(file_raw, output, filesystem::open_mode_write_existing, p_abort);
+            file_raw->resize(size, p_abort);
+            file_raw->seek(resume_from, p_abort);
+            written = resume_from + transfer_audio(file_raw, resume_from, size, p_abort);
+        } else if (uncached_out) {
+            auto range = [&](ncm_file &f, uint64_t begin, uint64_t end) {
+                return f.transfer_audio(*uncached_in, *uncached_out, begin, end, p_abort);
+            };
+            written = split ? transfer_audio_split(size, range, p_abort) : range(*this, 0, size);
+            uncached_out->truncate(size); // the last write is padded
+        } else if (mapped) {
+            auto range = [&](ncm_file &f, uint64_t begin, uint64_t end) { return f.transfer_audio(mapped->data(), begin, end, p_abort); };
+            written = split ? transfer_audio_split(size, range, p_abort) : range(*this, 0, size);
+            mapped->close();
+        } else {
+            file_ptr file_raw;
+            filesystem::g_open_write_new(file_raw, output, p_abort);
+            if (split) {
+                file_raw->resize(size, p_abort);
+                std::mutex out_mutex;
+                written = transfer_audio_split(
+                    size, [&](ncm_file &f, uint64_t begin, uint64_t end) { return f.transfer_audio(file_raw, begin, end, p_abort, &out_mutex); },
+                    p_abort);
+            } else {
+                written = transfer_audio(file_raw, 0, size, p_abort);
+            }
+        }
+        if (written == size) {
             DEBUG_LOG("Extraction done: ", output);
             path_raw_saved_to_ = output;
+            if (manifest) {
+                if (auto entry = manifest->find(path()); entry.has_value()) {
+                    chunk_hasher hasher;
+                    hasher.update(reinterpret_cast<const uint8_t *>(entry->chunks.data()), entry->chunks.size() * sizeof(uint64_t));
+                    entry->checksum = hasher.digest();
+                    entry->complete = true;
+                    manifest->update(path(), std::move(*entry));
+                }
+                manifest->save();
+            }
             return true;
         }
     } catch (const exception_aborted &) {
@@ -309,176 +879,761 @@ bool ncm_file::save_raw_audio(const char *to_dir, abort_callback &p_abort) {
     } catch (const pfc::exception &e) {
         ERROR_LOG(e.what(), " (writing ", output, ") ");
     }
+    if (manifest) {
+        manifest->save(); // keep the progress of this file
+    }
     DEBUG_LOG("Extraction failed: ", path());
     path_raw_saved_to_.clear();
     return false;
 }
 
-void ncm_file::overwrite_meta(const nlohmann::json &overwrite, abort_callback &p_abort) {
-    if (!meta_parsed()) {
-        this->parse(parse_targets::NCM_PARSE_META);
+/// @brief Extract the audio with `info` and `cover` as its own tags (FLAC metadata blocks or an ID3v2 tag, see tag_builder),
+/// written in front of the audio frames in one sequential pass.
+/// @note Audio of an unrecognized format, or FLAC with malformed metadata blocks, is extracted as is by save_raw_audio().
+/// Tagged outputs are recorded in the manifest to be skipped next time, but an interrupted one is written again from the start.
+bool ncm_file::save_tagged_audio(const char *to_dir, const file_info &info, const album_art_data_ptr &cover, abort_callback &p_abort,
+                                 extraction_manifest *manifest) {
+    raw_reused_ = false;
+    if (!audio_key_parsed() || !meta_parsed()) {
+        if (auto err = try_parse(parse_targets::NCM_PARSE_AUDIO | parse_targets::NCM_PARSE_META); err != parse_error::ok) {
+            WARN_LOG("Skipped (", describe(err), "): ", path());
+            path_raw_saved_to_.clear();
+            return false;
+        }
     }
-    auto _seek_guard_ = make_seek_guard();
+    ENSURE_DECRYPTOR();
+    // same as input_ncm::open(): trust the format hint of the meta, the head is only sniffed without one
+    // (an ID3 tag can be prepended to FLAC as well)
+    std::string_view format;
+    if (meta_info().is_object() && meta_info().contains("format") && meta_info()["format"].is_string()) {
+        format = meta_info()["format"].get_ref<const nlohmann::json::string_t &>();
+    } else {
+        format = sniff_audio_format(p_abort);
+    }
+    if (format != "flac"sv && format != "mp3"sv) {
+        WARN_LOG("Unrecognized audio format, extracted without tags: ", path());
+        return save_raw_audio(to_dir, p_abort, manifest);
+    }
+    auto output = pfc::string(to_dir);
+    output.add_filename(pfc::string_filename(this->path()));
+    output += format == "flac"sv ? ".ncm.flac" : ".ncm.mp3";
 
-    // check if source file is opened in write mode
-    source_->seek_ex(0, seek_from_beginning, p_abort);
-    auto magic = ncm_magic;
-    source_->write(&magic, sizeof(magic), p_abort);
-    // passed
+    auto _seek_guard_ = make_seek_guard(fb2k::noAbort);
+    try {
+        const auto size = this->get_size(p_abort);
+        // the tags the audio starts with are replaced, `skip` is where the frames start
+        uint64_t skip = 0;
+        std::vector<uint8_t> tags;
+        const auto fields = tag_fields(info);
+        const auto cover_bytes = cover.is_valid() ? std::span(static_cast<const uint8_t *>(cover->get_ptr()), cover->get_size())
+                                                  : std::span<const uint8_t>();
+        if (format == "flac"sv) {
+            // the blocks are bounded by the audio itself and a sane limit, a corrupt length can't make us read the whole file
+            const auto limit = std::min<uint64_t>(size, tag_builder::flac_max_blocks_size);
+            std::vector<uint8_t> blocks;
+            this->seek(4, p_abort); // "fLaC"
+            bool valid = true;
+            for (bool last = false; valid && !last;) {
+                uint8_t block_header[4];
+                this->read_object(block_header, sizeof(block_header), p_abort);
+                last = block_header[0] & 0x80;
+                const auto len = tag_builder::flac_block_size(block_header);
+                valid = len.has_value() && 4 + blocks.size() + sizeof(block_header) + *len <= limit;
+                if (valid) {
+                    blocks.insert(blocks.end(), block_header, block_header + sizeof(block_header));
+                    blocks.resize(blocks.size() + *len);
+                    this->read_object(blocks.data() + blocks.size() - *len, *len, p_abort);
+                }
+            }
+            std::optional<std::vector<uint8_t>> flac_tags;
+            if (valid) {
+                flac_tags = tag_builder::flac_header(blocks, fields, cover_bytes);
+            }
+            if (!flac_tags.has_value()) {
+                WARN_LOG("Malformed FLAC metadata blocks, extracted without tags: ", path());
+                return save_raw_audio(to_dir, p_abort, manifest);
+            }
+            if (!cover_bytes.empty() && !tag_builder::flac_picture_fits(cover_bytes)) {
+                WARN_LOG("Cover too large for a FLAC metadata block, the cover of the audio is kept (", cover_bytes.size(), " bytes)");
+            }
+            skip = 4 + blocks.size();
+            tags = std::move(*flac_tags);
+        } else {
+            uint8_t head[10] = {};
+            this->seek(0, p_abort);
+            if (this->read(head, sizeof(head), p_abort) == sizeof(head)) {
+                skip = std::min<uint64_t>(tag_builder::id3v2_size(head), size);
+            }
+            tags = tag_builder::id3v2_tag(fields, cover_bytes);
+        }
+        const auto output_size = tags.size() + (size - skip);
 
-    // embed overwriting meta into the source
+        if (manifest) {
+            auto current = manifest_entry(output, output_size, p_abort);
+            current.post_processed = true;
+            if (auto recorded = manifest->find(path()); recorded && recorded->same_source(current) && recorded->complete &&
+                                                        recorded->post_processed && recorded->output == current.output &&
+                                                        output_exists(current.output.c_str(), output_size, p_abort)) {
+                DEBUG_LOG("Unchanged since the last extraction: ", path());
+                path_raw_saved_to_ = recorded->output;
+                raw_reused_ = true;
+                return true;
+            }
+            manifest->update(path(), current);
+        }
 
-    auto meta_str_to_write = std::string("music:");
-    nlohmann::ordered_json live_meta =
-        nlohmann::ordered_json::parse(meta_str_); // NOTE: use unmodified raw json string to keep stricted order
-    if (live_meta.contains(overwrite_key)) {
-        live_meta.erase(overwrite_key); // replace the old key
+        file_ptr file_out;
+        filesystem::g_open_write_new(file_out, output, p_abort);
+        file_out->write(tags.data(), tags.size(), p_abort);
+        if (auto written = transfer_audio(file_out, skip, size, p_abort); written == size - skip) {
+            DEBUG_LOG("Extraction done (tagged): ", output);
+            path_raw_saved_to_ = output;
+            if (manifest) {
+                if (auto entry = manifest->find(path()); entry.has_value()) {
+                    entry->complete = true;
+                    manifest->update(path(), std::move(*entry));
+                }
+                manifest->save();
+            }
+            return true;
+        }
+    } catch (const exception_aborted &) {
+        DEBUG_LOG("Aborted: ", path());
+    } catch (const pfc::exception &e) {
+        ERROR_LOG(e.what(), " (writing ", output, ") ");
     }
+    DEBUG_LOG("Extraction failed: ", path());
+    path_raw_saved_to_.clear();
+    return false;
+}
 
-    if (auto size = overwrite.size(); size > 0)
-        do {
-            if (size == 1 && overwrite.contains(foo_input_ncm_comment_key)) {
-                break;
+/// @note
+/// - Reading, decryption and writing run on their own threads, connected by bounded queues of large buffers,
+/// so that the source disk, the CPU and the target disk are kept busy at the same time.
+/// The buffers are recycled through `free_chunks`, at most `extract_queue_depth` of them exist.
+/// @note
+/// - Every stage checks p_abort per chunk, a failing stage closes all queues to stop the others.
+/// @note
+/// - With `out_mutex`, each chunk is written at its own offset (seek + write under the lock), for ranges sharing one output.
+/// Otherwise `out` is written sequentially from its current position.
+uint64_t ncm_file::transfer_audio(const file_ptr &out, uint64_t begin, uint64_t end, abort_callback &p_abort, std::mutex *out_mutex) {
+    ensure_audio_offset();
+    struct chunk_st {
+        std::vector<uint8_t> data;
+        uint64_t offset = 0; // in the audio content
+        size_t size = 0;
+    };
+    bounded_queue<chunk_st> free_chunks(extract_queue_depth), read_chunks(extract_queue_depth), decrypted_chunks(extract_queue_depth);
+    for (size_t i = 0; i < extract_queue_depth; ++i) {
+        free_chunks.push({std::vector<uint8_t>(extract_chunk_size)});
+    }
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto fail = [&](std::exception_ptr e) {
+        {
+            std::lock_guard lock(error_mutex);
+            if (!error) {
+                error = e;
             }
-            live_meta[overwrite_key] = overwrite;
-            live_meta[overwrite_key].emplace(foo_input_ncm_comment_key, foo_input_ncm_comment);
-        } while (false);
-    meta_str_to_write += live_meta.dump();
+        }
+        free_chunks.close();
+        read_chunks.close();
+        decrypted_chunks.close();
+    };
 
-    DEBUG_LOG_F("Overwriting meta (to {}): {}", this->path(), meta_str_to_write);
+    std::thread decrypt_stage([&, &decryptor = std::as_const(rc4_decryptor_)] {
+        try {
+            while (auto chunk = read_chunks.pop()) {
+                p_abort.check();
+                decryptor.apply(chunk->data.data(), chunk->size, chunk->offset);
+                if (!decrypted_chunks.push(std::move(*chunk))) {
+                    return;
+                }
+            }
+            decrypted_chunks.close();
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    });
+    uint64_t written = 0; // read after join()
+    std::thread write_stage([&] {
+        try {
+            while (auto chunk = decrypted_chunks.pop()) {
+                p_abort.check();
+                if (out_mutex) {
+                    std::lock_guard lock(*out_mutex);
+                    out->seek(chunk->offset, p_abort);
+                    out->write(chunk->data.data(), chunk->size, p_abort);
+                } else {
+                    out->write(chunk->data.data(), chunk->size, p_abort);
+                }
+                track(chunk->offset, chunk->data.data(), chunk->size);
+                written += chunk->size;
+                if (!free_chunks.push(std::move(*chunk))) {
+                    return;
+                }
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    });
 
-    // NOTE: meta json processing:
-    // 1. read <meta_len>
-    // 2. XOR each byte by 0x63
-    // 3. format: "163 key(Don't modify):<base64>"
-    // 4. base64 decode
-    // 5. AES ECB decrypt (pkcs#7 padding)
-    // 6. "music:" <json>
+    // read stage, on the calling thread
+    try {
+        source_->seek(parsed_file_.audio_content_offset + begin, p_abort);
+        for (uint64_t offset = begin; offset < end;) {
+            auto chunk = free_chunks.pop();
+            if (!chunk) { // failed in another stage
+                break;
+            }
+            p_abort.check();
+            const auto len = static_cast<size_t>(std::min<uint64_t>(chunk->data.size(), end - offset));
+            {
+                auto ticket = io_governor::instance().acquire(len, p_abort);
+                chunk->size = source_->read(chunk->data.data(), len, p_abort);
+            }
+            chunk->offset = offset;
+            offset += chunk->size;
+            if (!chunk->size || !read_chunks.push(std::move(*chunk))) {
+                break;
+            }
+        }
+        read_chunks.close();
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    decrypt_stage.join();
+    write_stage.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return written;
+}
 
-    size_t meta_aligned_size = cipher::aligned(meta_str_to_write.size());
-    auto _step1_handle_padding = [&] {
-        uint8_t padding = static_cast<uint8_t>(meta_aligned_size - meta_str_to_write.size());
-        meta_str_to_write.reserve(meta_aligned_size);
-        for (auto i = meta_str_to_write.size(); i < meta_aligned_size; ++i) {
-            meta_str_to_write.push_back(padding);
+/// @brief Decrypt [begin, end) of the audio content straight into `out` (the whole mapped output), without a staging buffer.
+uint64_t ncm_file::transfer_audio(uint8_t *out, uint64_t begin, uint64_t end, abort_callback &p_abort) {
+    ensure_audio_offset();
+#ifdef _WIN32
+    if (pfc::string8 native; foobar2000_io::extract_native_path(path(), native)) {
+        if (auto n = transfer_audio_overlapped(native, out, begin, end, p_abort); n.has_value()) {
+            return *n;
         }
+    }
+#endif
+    // blocking reads, covered by running more workers (see worker_pool)
+    source_->seek(parsed_file_.audio_content_offset + begin, p_abort);
+    auto offset = begin;
+    while (offset < end) {
+        p_abort.check();
+        const auto len = static_cast<size_t>(std::min<uint64_t>(extract_chunk_size, end - offset));
+        auto ticket = io_governor::instance().acquire(len, p_abort);
+        auto n = source_->read(out + offset, len, p_abort);
+        if (!n) {
+            break;
+        }
+        rc4_decryptor_.apply(out + offset, n, offset);
+        track(offset, out + offset, n);
+        offset += n;
+    }
+    return offset - begin;
+}
+
+#ifdef _WIN32
+/// @brief Keep `extract_queue_depth` overlapped reads in flight straight into the mapped output,
+/// and decrypt each chunk as soon as its read completes. Writing the mapped pages back is asynchronous already,
+/// so one thread keeps both disks busy, instead of the three of the staged pipeline.
+/// @return std::nullopt if the source can't be opened for overlapped I/O
+std::optional<uint64_t> ncm_file::transfer_audio_overlapped(const char *native_in, uint8_t *out, uint64_t begin, uint64_t end,
+                                                            abort_callback &p_abort) {
+    HANDLE in = CreateFileW(pfc::stringcvt::string_wide_from_utf8(native_in), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                            OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (in == INVALID_HANDLE_VALUE) {
+        DEBUG_LOG("Overlapped open failed (", GetLastError(), "): ", native_in);
+        return std::nullopt;
+    }
+    struct read_st {
+        OVERLAPPED ov{};
+        uint64_t offset = 0; // in the audio content
+        DWORD len = 0;
+        bool pending = false;
+        io_governor::ticket ticket;
     };
-    [[maybe_unused]] auto _step2_aes = [&](uint8_t *meta_raw) -> size_t {
-        auto total = cipher::make_AES_context_with_key(ncm_meta_aes_key)
-                         .set_chain_mode(cipher::aes_chain_mode::ECB)
-                         .set_input(meta_raw, meta_aligned_size)
-                         .set_output(meta_raw, meta_aligned_size)
-                         .encrypt_chunk(meta_aligned_size)
-                         .outputted_len();
-        if (total != meta_aligned_size) {
-            uBugCheck();
-        }
-        return total; // should be equal to meta_aligned_size
-    };
-    auto _step3_base64 = [&](void *meta_raw) -> pfc::string {
-        pfc::string out;
-        pfc::base64_encode(out, meta_raw, meta_aligned_size);
-        return pfc::string(meta_b64_hint.data(), meta_b64_hint.size()) + out;
-    };
-    auto _step4_xor = [&](pfc::string &&meta_b64) {
-        auto out_raw = std::make_unique<uint8_t[]>(meta_b64.get_length());
-        std::span<uint8_t> s(out_raw.get(), meta_b64.get_length());
-        std::copy(meta_b64.get_ptr(), meta_b64.get_ptr() + meta_b64.get_length(), s.begin());
-        std::for_each(s.begin(), s.end(), [](auto &b) { b ^= 0x63; });
-        return out_raw;
+    std::array<read_st, extract_queue_depth> reads;
+    // pending reads must be finished before their buffers (the mapping) go away, also on errors and abort
+    auto _cleanup_ = std::shared_ptr<void>(nullptr, [&](auto...) {
+        CancelIoEx(in, nullptr);
+        for (auto &r : reads) {
+            if (DWORD n = 0; r.pending) {
+                GetOverlappedResult(in, &r.ov, &n, TRUE);
+            }
+            if (r.ov.hEvent) {
+                CloseHandle(r.ov.hEvent);
+            }
+        }
+        CloseHandle(in);
+    });
+    for (auto &r : reads) {
+        if (r.ov.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr); !r.ov.hEvent) {
+            return std::nullopt;
+        }
+    }
+
+    // reads[head] is the oldest pending read, the others follow it in issue order
+    auto next = begin;
+    size_t head = 0, pending = 0;
+    auto issue_more = [&] {
+        while (next < end && pending < reads.size()) {
+            auto &r = reads[(head + pending) % reads.size()];
+            const auto len = static_cast<DWORD>(std::min<uint64_t>(extract_chunk_size, end - next));
+            // only wait for the governor with nothing in flight, otherwise take what it allows right now
+            if (pending == 0) {
+                r.ticket = io_governor::instance().acquire(len, p_abort);
+            } else if (auto t = io_governor::instance().try_acquire(len); t.has_value()) {
+                r.ticket = std::move(*t);
+            } else {
+                return;
+            }
+            r.offset = next;
+            r.len = len;
+            next += len;
+            const auto pos = parsed_file_.audio_content_offset + r.offset;
+            r.ov.Offset = static_cast<DWORD>(pos);
+            r.ov.OffsetHigh = static_cast<DWORD>(pos >> 32);
+            ResetEvent(r.ov.hEvent);
+            if (!ReadFile(in, out + r.offset, r.len, nullptr, &r.ov) && GetLastError() != ERROR_IO_PENDING) {
+                throw exception_io();
+            }
+            r.pending = true;
+            ++pending;
+        }
     };
 
-    _step1_handle_padding();
-    _step2_aes(reinterpret_cast<uint8_t *>(meta_str_to_write.data()));
-    auto meta_b64 = _step3_base64(meta_str_to_write.data());
-    const uint32_t new_meta_raw_len = static_cast<uint32_t>(meta_b64.get_length());
-    auto new_meta_raw = _step4_xor(std::move(meta_b64));
+    auto done = begin;
+    for (issue_more(); pending; issue_more()) {
+        auto &r = reads[head];
+        while (WaitForSingleObject(r.ov.hEvent, 100) == WAIT_TIMEOUT) {
+            p_abort.check();
+        }
+        DWORD n = 0;
+        const bool ok = GetOverlappedResult(in, &r.ov, &n, FALSE) != FALSE;
+        r.pending = false;
+        r.ticket = {};
+        head = (head + 1) % reads.size();
+        --pending;
+        if (!ok) {
+            if (GetLastError() == ERROR_HANDLE_EOF) {
+                break;
+            }
+            throw exception_io();
+        }
+        rc4_decryptor_.apply(out + r.offset, n, r.offset);
+        track(r.offset, out + r.offset, n);
+        done += n;
+        if (n < r.len) { // end of file
+            break;
+        }
+        p_abort.check();
+    }
+    return done - begin;
+}
+#endif
 
-    // NOTE: to be as transactional as possible,
-    // a temp file is used to store the whole content, and then write back to the source file at once.
+/// @brief Decrypt [begin, end) of the audio content from `in` (this file, opened natively) to `out`, both bypassing the system cache.
+/// @note The audio content isn't aligned in the source, so each chunk is read as the aligned block around it and moved into place.
+/// `begin` is aligned (0 or a range boundary), only the last write of the file is padded, to be truncated by the caller.
+uint64_t ncm_file::transfer_audio(uncached_file &in, uncached_file &out, uint64_t begin, uint64_t end, abort_callback &p_abort) {
+    ensure_audio_offset();
+    constexpr auto align = uncached_file::alignment;
+    auto round_up = [](uint64_t n) { return (n + align - 1) / align * align; };
+    std::vector<uint8_t> storage(extract_chunk_size + 2 * align);
+    auto *buffer = reinterpret_cast<uint8_t *>(round_up(reinterpret_cast<uintptr_t>(storage.data())));
 
-    file_ptr tmp_file;
-    if (source_->get_size(fb2k::noAbort) > max_memfile_size) {
-        filesystem::g_open_temp(tmp_file, p_abort);
-    } else {
-        filesystem::g_open_tempmem(tmp_file, p_abort);
+    const auto skew = static_cast<size_t>(parsed_file_.audio_content_offset % align);
+    auto offset = begin;
+    while (offset < end) {
+        p_abort.check();
+        const auto len = static_cast<size_t>(std::min<uint64_t>(extract_chunk_size, end - offset));
+        auto ticket = io_governor::instance().acquire(len, p_abort);
+        const auto n = in.read_at(buffer, static_cast<size_t>(round_up(skew + len)), parsed_file_.audio_content_offset + offset - skew);
+        if (n <= skew) {
+            break;
+        }
+        const auto got = std::min(n - skew, len);
+        std::memmove(buffer, buffer + skew, got);
+        rc4_decryptor_.apply(buffer, got, offset);
+        track(offset, buffer, got);
+        out.write_at(buffer, static_cast<size_t>(round_up(got)), offset);
+        offset += got;
+        if (got < len) {
+            break;
+        }
     }
+    return offset - begin;
+}
 
-    source_->seek(0, p_abort);
-    file::g_transfer(source_, tmp_file, parsed_file_.meta_offset - sizeof(parsed_file_.meta_len), p_abort);
+/// @brief Extract one huge file with several workers, instead of keeping a batch waiting on a single core.
+/// @note The keystream can be addressed by any offset, so the audio content is split into ranges decrypted independently.
+/// Ranges are aligned to verify_chunk_size (a multiple of the 256-byte keystream period, and of the manifest pieces),
+/// and written into the pre-sized output.
+/// Each range reads through its own ncm_file instance, the header is shared by the registry.
+uint64_t ncm_file::transfer_audio_split(uint64_t size, const range_transfer_t &transfer_range, abort_callback &p_abort) {
+    const auto workers = std::max<uint64_t>(worker_pool::instance().concurrency(), 1);
+    auto range_size = std::max<uint64_t>((size + workers - 1) / workers, min_split_range_size);
+    range_size = (range_size + verify_chunk_size - 1) / verify_chunk_size * verify_chunk_size;
+    // a manifest piece must not be shared by two ranges, they would feed it out of order
+    static_assert(verify_chunk_size % 256 == 0, "ranges must start at a keystream period");
+    PFC_ASSERT(range_size % verify_chunk_size == 0);
 
-    tmp_file->write_lendian_t(new_meta_raw_len, p_abort);
-    tmp_file->write(new_meta_raw.get(), new_meta_raw_len, p_abort);
+    std::atomic<uint64_t> written = 0;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    std::vector<worker_pool::task_st> tasks;
+    for (uint64_t begin = 0; begin < size; begin += range_size) {
+        const auto end = std::min(begin + range_size, size);
+        tasks.push_back({end - begin, [&, begin, end] {
+                             try {
+                                 if (std::lock_guard lock(error_mutex); error) { // another range failed, don't bother
+                                     return;
+                                 }
+                                 auto part = fb2k::service_new<ncm_file>(this_path_);
+                                 part->parse(parse_targets::NCM_PARSE_AUDIO);
+                                 part->tracker_ = tracker_;
+                                 written += transfer_range(*part, begin, end);
+                             } catch (...) {
+                                 std::lock_guard lock(error_mutex);
+                                 if (!error) {
+                                     error = std::current_exception();
+                                 }
+                             }
+                         }});
+    }
+    DEBUG_LOG_F("Extracting {} in {} ranges of {} bytes", path(), tasks.size(), range_size);
+    worker_pool::instance().run_batch(std::move(tasks));
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return written;
+}
 
-    // fix offset when everything is done
-    auto defer = [&, l = new_meta_raw_len, cur_offset = tmp_file->get_position(p_abort)](auto...) {
-        parsed_file_.meta_len = l;
-        parsed_file_.meta_offset = cur_offset - l;
-        parsed_file_.album_image_offset = cur_offset + sizeof(parsed_file_.unknown_gap_5b) + sizeof(parsed_file_.album_image_size);
-        parsed_file_.audio_content_offset = parsed_file_.album_image_offset + parsed_file_.album_image_size[0];
-    };
-    auto _defer_guard_ = std::shared_ptr<void>(nullptr, defer);
+bool ncm_file::overwrite_meta(const nlohmann::json &overwrite, abort_callback &p_abort) {
+    stage_meta(overwrite);
+    return commit_edits(p_abort);
+}
 
-    // copy remaining content
-    source_->seek_ex(parsed_file_.meta_offset + parsed_file_.meta_len, seek_from_beginning, p_abort);
-    uint64_t remain_size = source_->get_size(p_abort) - source_->get_position(p_abort);
-    file::g_transfer(source_, tmp_file, remain_size, p_abort);
+bool ncm_file::reset_album_image(album_art_data_ptr image, abort_callback &p_abort) {
+    stage_album_image(std::move(image));
+    return commit_edits(p_abort);
+}
 
-    // commit to current file
-    tmp_file->seek(0, fb2k::noAbort);
-    source_->truncate(0, fb2k::noAbort);
-    file::g_transfer_file(tmp_file, source_, p_abort);
-    source_->commit(fb2k::noAbort);
+void ncm_file::stage_meta(const nlohmann::json &overwrite) {
+    pending_edits_.overwrite = overwrite;
 }
 
-void ncm_file::reset_album_image(album_art_data_ptr image, abort_callback &p_abort) {
-    if (!album_image_parsed()) {
-        this->parse(parse_targets::NCM_PARSE_ALBUM);
+void ncm_file::stage_album_image(album_art_data_ptr image) {
+    pending_edits_.album_image = std::move(image);
+}
+
+void ncm_file::stage_embedded(std::function<void(abort_callback &)> &&writer) {
+    pending_edits_.embedded.emplace_back(std::move(writer));
+}
+
+bool ncm_file::commit_edits(abort_callback &p_abort) {
+    auto pending = std::exchange(pending_edits_, {});
+    // writes made outside of staged edits are reported here too, not lost in the destructor
+    flush_writes(p_abort);
+    if (!pending.overwrite && !pending.album_image && pending.embedded.empty()) {
+        return false;
+    }
+    // tags inside the audio content go first, they're written by other inputs through this->write()
+    for (auto &writer : pending.embedded) {
+        writer(p_abort);
+    }
+    flush_writes(p_abort);
+    if (!pending.overwrite && !pending.album_image) {
+        return true;
+    }
+
+    if (!meta_parsed()) {
+        this->parse(parse_targets::NCM_PARSE_META);
     }
     auto _seek_guard_ = make_seek_guard();
 
-    // NOTE: also transactional
+    // NOTE: Mass "write tags" runs mostly end up here with nothing changed, never touch the disk for them.
+    std::optional<std::vector<uint8_t>> meta_field;
+    if (pending.overwrite) {
+        meta_field = encode_meta_field(*pending.overwrite);
+    }
+    if (pending.album_image && same_album_image(*pending.album_image, p_abort)) {
+        pending.album_image.reset();
+    }
+    if (!meta_field && !pending.album_image) {
+        if (pending.embedded.empty()) {
+            DEBUG_LOG("Nothing changed, skipped writing ", this->path());
+        }
+        return !pending.embedded.empty();
+    }
 
-    file_ptr tmp_file;
-    if (source_->get_size(fb2k::noAbort) > max_memfile_size) {
-        filesystem::g_open_temp(tmp_file, p_abort);
-    } else {
-        filesystem::g_open_tempmem(tmp_file, p_abort);
+    // NOTE: meta and album image live in the same header block, so any combination of them costs a single rewrite.
+    if (!meta_field) {
+        meta_field = read_raw(parsed_file_.meta_offset - sizeof(parsed_file_.meta_len),
+                              sizeof(parsed_file_.meta_len) + parsed_file_.meta_len, p_abort);
+    }
+    std::vector<uint8_t> image_kept;
+    std::span<const uint8_t> image_bytes;
+    if (!pending.album_image) {
+        image_kept = read_raw(parsed_file_.album_image_offset, parsed_file_.album_image_size[1], p_abort);
+        image_bytes = image_kept;
+    } else if (pending.album_image->is_valid()) {
+        image_bytes = {static_cast<const uint8_t *>((*pending.album_image)->get_ptr()), (*pending.album_image)->get_size()};
+    }
+    commit_header(*meta_field, image_bytes, p_abort);
+    return true;
+}
+
+bool ncm_file::same_album_image(const album_art_data_ptr &image, abort_callback &p_abort) {
+    const size_t size = image.is_valid() ? image->get_size() : 0;
+    if (size != parsed_file_.album_image_size[1]) {
+        return false;
+    }
+    if (!size) {
+        return true;
+    }
+    if (album_image_parsed() && !header_->album_image_deferred) {
+        return !memcmp(image->get_ptr(), image_data().data(), size);
     }
+    return !memcmp(image->get_ptr(), read_raw(parsed_file_.album_image_offset, size, p_abort).data(), size);
+}
 
-    source_->seek(0, p_abort);
-    file::g_transfer(source_, tmp_file, parsed_file_.album_image_offset - sizeof(parsed_file_.album_image_size), p_abort);
+std::optional<std::vector<uint8_t>> ncm_file::encode_meta_field(const nlohmann::json &overwrite) {
+    // embed overwriting meta into the source
 
-    uint32_t img_size = 0;
-    if (image.is_valid()) {
-        img_size = static_cast<uint32_t>(image->get_size());
+    // NOTE:
+    // Only the top-level `overwrite` member is spliced into the original text,
+    // the rest of the document is never re-serialized, so the key order and formatting are kept exactly.
+    const auto &live_meta = header_->meta_str;
+    const auto scan = scan_json_member(live_meta, overwrite_key);
+    if (!scan.valid) [[unlikely]] {
+        throw_format_error("meta info is not a JSON object");
     }
 
-    tmp_file->write_lendian_t(img_size, p_abort);
-    tmp_file->write_lendian_t(img_size, p_abort);
-    if (img_size) {
-        tmp_file->write(image->get_ptr(), img_size, p_abort);
+    std::string new_meta = live_meta;
+    if (auto size = overwrite.size(); size > 0 && !(size == 1 && overwrite.contains(foo_input_ncm_comment_key))) {
+        auto value = overwrite;
+        value.emplace(foo_input_ncm_comment_key, foo_input_ncm_comment);
+        if (scan.found) { // replace the old value
+            new_meta.replace(scan.value_begin, scan.value_end - scan.value_begin, value.dump());
+        } else {
+            const auto insert_at = scan.empty ? scan.close : new_meta.find_last_not_of(" \t\r\n", scan.close - 1) + 1;
+            new_meta.insert(insert_at, fmtlib::format("{}\"{}\":{}", scan.empty ? "" : ",", overwrite_key, value.dump()));
+        }
+    } else if (scan.found) { // remove the member along with one of its separators
+        if (new_meta[scan.sep] == ',') {
+            new_meta.erase(scan.sep, scan.term - scan.sep);
+        } else if (new_meta[scan.term] == ',') {
+            new_meta.erase(scan.sep + 1, scan.term - scan.sep);
+        } else {
+            new_meta.erase(scan.sep + 1, scan.term - scan.sep - 1);
+        }
+    }
+    if (new_meta == live_meta) {
+        return std::nullopt;
     }
+    DEBUG_LOG_F("Overwriting meta (to {}): {}", this->path(), new_meta);
 
-    auto defer = [&, l = img_size, cur_offset = tmp_file->get_position(fb2k::noAbort)](auto...) {
-        parsed_file_.album_image_size[0] = l;
-        parsed_file_.album_image_size[1] = l;
-        parsed_file_.album_image_offset = cur_offset - l;
-        parsed_file_.audio_content_offset = cur_offset;
-    };
-    auto _defer_guard_ = std::shared_ptr<void>(nullptr, defer);
+    // NOTE: meta json processing:
+    // 1. read <meta_len>
+    // 2. XOR each byte by 0x63
+    // 3. format: "163 key(Don't modify):<base64>"
+    // 4. base64 decode
+    // 5. AES ECB decrypt (pkcs#7 padding)
+    // 6. "music:" <json>
+    // cipher::meta_codec::encode() does it backwards in one pass
 
-    source_->seek(parsed_file_.audio_content_offset, p_abort);
-    auto remain_size = source_->get_size(p_abort) - parsed_file_.audio_content_offset;
-    file::g_transfer(source_, tmp_file, remain_size, p_abort);
+    const auto &codec = meta_field_codec();
+    const auto field_len = static_cast<uint32_t>(codec.encoded_size("music:"sv.size() + new_meta.size()));
+    std::vector<uint8_t> meta_field(reinterpret_cast<const uint8_t *>(&field_len), reinterpret_cast<const uint8_t *>(&field_len) + sizeof(field_len));
+    meta_field.reserve(sizeof(field_len) + field_len);
+    codec.encode({"music:"sv, new_meta}, [&](const uint8_t *p, size_t n) { meta_field.insert(meta_field.end(), p, p + n); });
+    return meta_field;
+}
 
-    source_->set_eof(p_abort);
-    source_->write(&parsed_file_.album_image_size, sizeof(parsed_file_.album_image_size), p_abort);
-    if (img_size) {
-        source_->write(image->get_ptr(), img_size, p_abort);
+std::vector<uint8_t> ncm_file::read_raw(uint64_t offset, uint64_t len, abort_callback &p_abort) {
+    std::vector<uint8_t> out(static_cast<size_t>(len));
+    source_->seek(offset, p_abort);
+    source_->read_object(out.data(), out.size(), p_abort);
+    return out;
+}
+
+void ncm_file::commit_header(std::span<const uint8_t> meta_field, std::span<const uint8_t> image, abort_callback &p_abort) {
+    // NOTE:
+    // The album image region (album_image_size[0]) may be larger than the image (album_image_size[1]),
+    // other readers skip the rest of it as well. We keep some slack there so that later edits fit without moving the audio.
+    // The rewritten part is always [meta_len, audio content), and it's written in place whenever its size doesn't change.
+    // The slack is capped though, e.g. replacing a large image by a small one shrinks the file instead of keeping megabytes of zeros.
+    const uint64_t begin = parsed_file_.meta_offset - sizeof(parsed_file_.meta_len);
+    const uint64_t end = parsed_file_.audio_content_offset;
+    const uint64_t fixed_size =
+        meta_field.size() + sizeof(parsed_file_.unknown_gap_5b) + sizeof(parsed_file_.album_image_size) + image.size();
+    const uint64_t slack = config::album_image_slack();
+    const uint64_t region_size = fixed_size <= end - begin && end - begin - fixed_size <= slack
+                                     ? image.size() + (end - begin - fixed_size) // absorbed by the slack
+                                     : image.size() + slack;                     // reserve for next time
+    const uint32_t sizes[2] = {static_cast<uint32_t>(region_size), static_cast<uint32_t>(image.size())};
+
+    const uint64_t block_size = fixed_size - image.size() + region_size;
+    std::vector<uint8_t> block;
+    block.reserve(static_cast<size_t>(block_size));
+    block.insert(block.end(), meta_field.begin(), meta_field.end());
+    block.insert(block.end(), std::begin(parsed_file_.unknown_gap_5b), std::end(parsed_file_.unknown_gap_5b));
+    block.insert(block.end(), reinterpret_cast<const uint8_t *>(sizes), reinterpret_cast<const uint8_t *>(sizes) + sizeof(sizes));
+    block.insert(block.end(), image.begin(), image.end());
+    block.resize(static_cast<size_t>(block_size), 0); // the slack, the image region must end exactly where sizes[0] says
+    // the region size is stored as 32 bits, anything beyond would make readers look for the audio in the wrong place
+    if (region_size > UINT32_MAX || block.size() - (fixed_size - image.size()) != sizes[0]) [[unlikely]] {
+        throw exception_io_data("album image region too large");
+    }
+
+    if (block.size() == end - begin) {
+        DEBUG_LOG_F("Header rewritten in place ({} bytes, slack {}): {}", block.size(), region_size - image.size(), this->path());
+    }
+    splice_header(begin, end - begin, block, p_abort);
+
+    parsed_file_.meta_len = static_cast<uint32_t>(meta_field.size() - sizeof(parsed_file_.meta_len));
+    parsed_file_.album_image_offset = begin + fixed_size - image.size();
+    parsed_file_.album_image_size[0] = sizes[0];
+    parsed_file_.album_image_size[1] = sizes[1];
+    parsed_file_.audio_content_offset = begin + block.size();
+    invalidate_header();
+}
+
+void ncm_file::splice_header(uint64_t offset, uint64_t old_len, std::span<const uint8_t> field, abort_callback &p_abort) {
+    // NOTE:
+    // When the audio has to move, local files are rewritten through a temporary file renamed over the original,
+    // so that an interruption never leaves a half-moved file behind. Moving the tail in place is the fallback,
+    // for remote files and when renaming isn't supported or there's no room for a second copy.
+    // A field of the same size is always written in place, nothing behind it moves.
+    if (!source_->can_seek()) [[unlikely]] {
+        // can't be edited in place, and the write check would throw on it
+        splice_header_via_rename(offset, old_len, field, p_abort);
+        return;
     }
-    tmp_file->seek(0, fb2k::noAbort);
-    source_->truncate(0, fb2k::noAbort);
-    file::g_transfer_file(tmp_file, source_, p_abort);
+    const bool rename_first = field.size() != old_len && !filesystem::g_is_remote_or_unrecognized(this_path_);
+    if (rename_first) {
+        try {
+            splice_header_via_rename(offset, old_len, field, p_abort);
+            return;
+        } catch (const exception_io_device_full &) {
+            WARN_LOG("No room for a temporary copy, editing in place: ", this->path());
+        } catch (const exception_io_denied &) {
+            WARN_LOG("Can't create a temporary copy, editing in place: ", this->path());
+        } catch (const pfc::exception_not_implemented &) {
+            DEBUG_LOG("Renaming not supported, editing in place: ", this->path());
+        }
+    }
+    splice_header_in_place(offset, old_len, field, !rename_first, p_abort);
+}
+
+void ncm_file::splice_header_in_place(uint64_t offset, uint64_t old_len, std::span<const uint8_t> field, bool rename_fallback,
+                                      abort_callback &p_abort) {
+    // check if source file is opened in write mode
+    source_->seek_ex(0, seek_from_beginning, p_abort);
+    auto magic = ncm_magic;
+    source_->write(&magic, sizeof(magic), p_abort);
+    // passed
+
+    // NOTE:
+    // Audio bytes are encrypted relative to `audio_content_offset`, so they can be moved as they are.
+    // Only the replaced field is written, plus one move of everything behind it.
+    const uint64_t size = source_->get_size(p_abort);
+    const uint64_t tail = offset + old_len;
+    const uint64_t new_len = field.size();
+    std::vector<uint8_t> buf(static_cast<size_t>(std::min<uint64_t>(tail_move_chunk_size, size - tail)));
+
+    if (new_len > old_len) {
+        // grow: move backwards from the end, so that no unmoved bytes get overwritten
+        const uint64_t delta = new_len - old_len;
+        try {
+            source_->resize(size + delta, p_abort);
+        } catch (const pfc::exception_not_implemented &) {
+            if (!rename_fallback) {
+                throw;
+            }
+            // nothing is touched yet
+            splice_header_via_rename(offset, old_len, field, p_abort);
+            return;
+        }
+        for (uint64_t end = size; end > tail;) {
+            const auto n = static_cast<size_t>(std::min<uint64_t>(buf.size(), end - tail));
+            end -= n;
+            source_->seek(end, p_abort);
+            source_->read_object(buf.data(), n, p_abort);
+            source_->seek(end + delta, p_abort);
+            source_->write_object(buf.data(), n, p_abort);
+        }
+    } else if (new_len < old_len) {
+        // shrink: move forwards from the tail, truncate afterwards
+        const uint64_t delta = old_len - new_len;
+        for (uint64_t pos = tail; pos < size;) {
+            const auto n = static_cast<size_t>(std::min<uint64_t>(buf.size(), size - pos));
+            source_->seek(pos, p_abort);
+            source_->read_object(buf.data(), n, p_abort);
+            source_->seek(pos - delta, p_abort);
+            source_->write_object(buf.data(), n, p_abort);
+            pos += n;
+        }
+        source_->resize(size - delta, p_abort);
+    }
+
+    source_->seek(offset, p_abort);
+    source_->write_object(field.data(), field.size(), p_abort);
     source_->commit(fb2k::noAbort);
 }
+
+void ncm_file::splice_header_via_rename(uint64_t offset, uint64_t old_len, std::span<const uint8_t> field, abort_callback &p_abort) {
+    // NOTE:
+    // The new content is written once to a file next to the original (so that renaming is atomic on the same volume),
+    // then renamed over it. The original file is never left half-written.
+    pfc::string8 tmp_path = this_path_;
+    tmp_path += ".ncm-tmp";
+    bool original_removed = false;
+    try {
+        {
+            file_ptr tmp_file;
+            filesystem::g_open_write_new(tmp_file, tmp_path, p_abort);
+            source_->seek(0, p_abort);
+            file::g_transfer(source_, tmp_file, offset, p_abort);
+            tmp_file->write_object(field.data(), field.size(), p_abort);
+            source_->seek(offset + old_len, p_abort);
+            file::g_transfer(source_, tmp_file, filesize_invalid, p_abort); // until EOF
+            tmp_file->commit(p_abort);
+        }
+        source_.release(); // can't replace an opened file on Windows
+        filesystem_v2::ptr fs_v2;
+        if (auto fs = filesystem::get(this_path_); fs->cast(fs_v2)) {
+            fs_v2->move_overwrite(tmp_path, this_path_, p_abort);
+        } else {
+            filesystem::g_remove(this_path_, p_abort);
+            original_removed = true;
+            filesystem::g_move(tmp_path, this_path_, fb2k::noAbort);
+        }
+    } catch (...) {
+        if (original_removed) {
+            // the temporary file is the only copy left, never delete it
+            ERROR_LOG("Failed to move the edited file back, it's kept as ", tmp_path);
+            // not one of the errors splice_header() falls back on, there's no source to edit in place anymore
+            throw exception_io("failed to replace the original file");
+        }
+        try {
+            filesystem::g_remove(tmp_path, fb2k::noAbort);
+        } catch (...) {
+        }
+        if (source_.is_empty()) {
+            filesystem::g_open(source_, this_path_, filesystem::open_mode_write_existing, fb2k::noAbort);
+        }
+        throw;
+    }
+    // offsets in parsed_file_ are fixed by the caller, they describe the new file already
+    // the file has been replaced, so don't let an abort leave this instance without a source
+    filesystem::g_open(source_, this_path_, filesystem::open_mode_write_existing, fb2k::noAbort);
+}
@@ -6,12 +6,20 @@
 #include "nlohmann/json.hpp"
 
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
 #include <string_view>
 #include <stdexcept>
 
 namespace fb2k_ncm
 {
     using json_t = nlohmann::json;
+    class uncached_file;
+    class extraction_manifest;
+    class chunk_tracker;
 
     /// @note
     /// - FB2K_MAKE_SERVICE_INTERFACE() is used for creating service interfaces,
@@ -45,6 +53,36 @@ namespace fb2k_ncm
             NCM_PARSE_AUDIO = 0b100,
         };
 
+        /// @brief Everything parse() extracts from the header.
+        /// @note Once built, it's read-only and shared (see `ncm_file_registry`) by all the ncm_file instances
+        /// opened on the same file. E.g. the input, the album art extractor and the editor of a track being displayed.
+        /// Each instance keeps its own cursor (source_) and decryptor counter.
+        struct parsed_header_st {
+            uint16_t parsed_targets = 0;
+            ncm_file_parsed_st parsed_file{};
+            std::string meta_str;
+            json_t meta_json;
+            cipher::abnormal_RC4 rc4_decryptor;
+            std::vector<uint8_t> album_image_data;
+            bool album_image_deferred = false; // larger than config::max_album_image_size(), not loaded
+        };
+        using header_ptr = std::shared_ptr<const parsed_header_st>;
+
+        /// @brief Why try_parse() rejected a file. I/O failures are not listed, they're still thrown by the source file.
+        enum class parse_error : uint8_t {
+            ok = 0,
+            truncated,       // file ends inside the header
+            magic_mismatch,  // not an ncm file at all
+            rc4_seed_length, // bad length of the rc4 seed field
+            rc4_seed_magic,  // rc4 seed decrypted to garbage
+            meta_hint,       // meta field doesn't start with `meta_b64_hint`
+            meta_cipher,     // meta field isn't valid base64 / AES payload
+            meta_schema,     // decrypted meta doesn't start with `music:`
+            meta_json,       // meta after `music:` isn't a json object
+            meta_oversized,  // meta field exceeds config::max_meta_size()
+            album_size,      // album image is larger than its region
+        };
+
     public:
         t_size read(void *p_buffer, t_size p_bytes, abort_callback &p_abort);
         void write(const void *p_buffer, t_size p_bytes, abort_callback &p_abort);
@@ -57,15 +95,44 @@ namespace fb2k_ncm
         void reopen(abort_callback &p_abort);
         bool is_remote();
         t_filetimestamp get_timestamp(abort_callback &p_abort);
+        void commit(abort_callback &p_abort);
 
     public:
-        explicit ncm_file(const char *path, filesystem::t_open_mode open_mode = filesystem::open_mode_read) : this_path_(path) {
+        explicit ncm_file(const char *path, filesystem::t_open_mode open_mode = filesystem::open_mode_read)
+            : this_path_(path), header_(std::make_shared<parsed_header_st>()) {
             filesystem::g_open(source_, path, open_mode, fb2k::noAbort);
+            if (!filesystem::g_get_canonical_path(path, canonical_path_)) {
+                canonical_path_ = path;
+            }
         }
+        ~ncm_file();
+        /// @brief Writes merged by write() are held until the next operation that moves the cursor, commit(), commit_edits() or this.
+        void flush_writes(abort_callback &p_abort = fb2k::noAbort);
+        /// @brief Throws exception_io_unsupported_format on corrupt files, a thin wrapper over try_parse().
         void parse(uint16_t to_parse = 0xffff);
-        bool save_raw_audio(const char *to_dir, abort_callback &p_abort = fb2k::noAbort);
-        void overwrite_meta(const nlohmann::json &overwrite, abort_callback &p_abort = fb2k::noAbort);
-        void reset_album_image(album_art_data_ptr image, abort_callback &p_abort = fb2k::noAbort);
+        /// @brief Same as parse() but reports format errors by return value, for bulk scans where bad files are common.
+        [[nodiscard]] parse_error try_parse(uint16_t to_parse = 0xffff);
+        static const char *describe(parse_error err);
+        /// @param manifest if given, outputs already complete are reused and interrupted ones continued (see extraction_manifest)
+        bool save_raw_audio(const char *to_dir, abort_callback &p_abort = fb2k::noAbort, extraction_manifest *manifest = nullptr);
+        /// @brief Same as save_raw_audio(), with `info` and `cover` written as the tags of the output.
+        bool save_tagged_audio(const char *to_dir, const file_info &info, const album_art_data_ptr &cover,
+                               abort_callback &p_abort = fb2k::noAbort, extraction_manifest *manifest = nullptr);
+        bool overwrite_meta(const nlohmann::json &overwrite, abort_callback &p_abort = fb2k::noAbort);
+        bool reset_album_image(album_art_data_ptr image, abort_callback &p_abort = fb2k::noAbort);
+        /// @brief Edits are staged and written together by commit_edits(), so that a full tag-and-art edit costs one rewrite.
+        /// overwrite_meta() / reset_album_image() are stage + commit, they also flush anything staged before.
+        void stage_meta(const nlohmann::json &overwrite);
+        void stage_album_image(album_art_data_ptr image); // empty ptr removes the image
+        /// @brief Tags inside the audio content (e.g. ReplayGain), written by another input's info writer on top of this file.
+        void stage_embedded(std::function<void(abort_callback &)> &&writer);
+        /// @return false if nothing staged differs from the file, which is left untouched then.
+        /// Callers running a batch count these to report how many files were skipped.
+        bool commit_edits(abort_callback &p_abort = fb2k::noAbort);
+        std::string_view sniff_audio_format(abort_callback &p_abort = fb2k::noAbort);
+        /// @brief The album image, either from the parsed header or read from the file if it was too large to keep.
+        /// @return empty ptr if there is no image.
+        album_art_data_ptr read_album_image(abort_callback &p_abort = fb2k::noAbort);
 
     private:
         inline void throw_format_error(const char *extra = nullptr);
@@ -73,25 +140,64 @@ namespace fb2k_ncm
         inline void ensure_audio_offset();
         inline void ensure_decryptor();
         [[nodiscard]] auto make_seek_guard(abort_callback &p_abort = fb2k::noAbort);
+        /// @brief The meta field (meta_len included) with `overwrite` applied, encrypted and encoded as stored in the file.
+        /// @return std::nullopt if the meta on disk already has this overwrite object
+        std::optional<std::vector<uint8_t>> encode_meta_field(const nlohmann::json &overwrite);
+        bool same_album_image(const album_art_data_ptr &image, abort_callback &p_abort);
+        /// @brief Rewrite everything from meta_len to the audio content, using the album image slack if possible.
+        void commit_header(std::span<const uint8_t> meta_field, std::span<const uint8_t> image, abort_callback &p_abort);
+        std::vector<uint8_t> read_raw(uint64_t offset, uint64_t len, abort_callback &p_abort);
+        auto manifest_entry(const char *output, uint64_t output_size, abort_callback &p_abort);
+        /// @brief Write the decrypted audio content in [begin, end) to `out`, independent of the cursor.
+        uint64_t transfer_audio(const file_ptr &out, uint64_t begin, uint64_t end, abort_callback &p_abort, std::mutex *out_mutex = nullptr);
+        uint64_t transfer_audio(uint8_t *out, uint64_t begin, uint64_t end, abort_callback &p_abort);
+        uint64_t transfer_audio(uncached_file &in, uncached_file &out, uint64_t begin, uint64_t end, abort_callback &p_abort);
+#ifdef _WIN32
+        std::optional<uint64_t> transfer_audio_overlapped(const char *native_in, uint8_t *out, uint64_t begin, uint64_t end,
+                                                          abort_callback &p_abort);
+#endif
+        using range_transfer_t = std::function<uint64_t(ncm_file &part, uint64_t begin, uint64_t end)>;
+        uint64_t transfer_audio_split(uint64_t size, const range_transfer_t &transfer_range, abort_callback &p_abort);
+        /// @brief Replace the header field at [offset, offset + old_len) with `field`, shifting everything behind it.
+        /// @note Local files are rewritten through a renamed temporary file, splice_header_in_place() is the fallback.
+        void splice_header(uint64_t offset, uint64_t old_len, std::span<const uint8_t> field, abort_callback &p_abort);
+        /// @param rename_fallback whether to go through a temporary file if the source can't be resized
+        void splice_header_in_place(uint64_t offset, uint64_t old_len, std::span<const uint8_t> field, bool rename_fallback,
+                                    abort_callback &p_abort);
+        void splice_header_via_rename(uint64_t offset, uint64_t old_len, std::span<const uint8_t> field, abort_callback &p_abort);
+        void adopt_header(header_ptr header);
+        void track(uint64_t offset, const uint8_t *data, size_t len);
+        void invalidate_header();
 
     public:
-        inline auto &meta_info() { return meta_json_; }
-        inline auto &image_data() { return album_image_data_; }
+        inline const auto &meta_info() const { return header_->meta_json; }
+        inline const auto &image_data() const { return header_->album_image_data; }
         inline auto path() const { return this_path_; }
-        inline bool meta_parsed() const { return meta_str_.size() > 0; }
+        inline bool meta_parsed() const { return header_->parsed_targets & parse_targets::NCM_PARSE_META; }
         inline bool audio_key_parsed() const { return rc4_decryptor_.is_valid(); }
-        inline bool album_image_parsed() const { return album_image_data_.capacity() > 0; }
+        inline bool album_image_parsed() const { return header_->parsed_targets & parse_targets::NCM_PARSE_ALBUM; }
         inline std::string_view saved_raw_path() const { return path_raw_saved_to_; }
+        /// @brief The last save_raw_audio() found its output complete already, and didn't write anything.
+        inline bool saved_raw_reused() const { return raw_reused_; }
 
     private:
         const char *this_path_ = nullptr;
+        pfc::string8 canonical_path_; // registry key
         ncm_file_parsed_st parsed_file_{};
         file_ptr source_;
-        std::string meta_str_;
-        nlohmann::json meta_json_;
-        cipher::abnormal_RC4 rc4_decryptor_;
-        std::vector<uint8_t> album_image_data_;
+        header_ptr header_;                  // shared, never modified in place
+        cipher::abnormal_RC4 rc4_decryptor_; // own copy, because the counter belongs to the cursor
         std::string path_raw_saved_to_;
+        bool raw_reused_ = false;
+        chunk_tracker *tracker_ = nullptr; // set during save_raw_audio() with a manifest
+        std::vector<uint8_t> write_buffer_; // plain bytes, encrypted when flushed
+        uint64_t write_buffer_offset_ = 0;  // where write_buffer_ starts in source_
+
+        struct pending_edits_st {
+            std::optional<nlohmann::json> overwrite;
+            std::optional<album_art_data_ptr> album_image;
+            std::vector<std::function<void(abort_callback &)>> embedded;
+        } pending_edits_;
     };
 
     FOOGUIDDECL constexpr GUID ncm_file::class_guid = guid_candidates[1];
@@ -2,114 +2,109 @@
 #include "context_menu.hpp"
 #include "common/helpers.hpp"
 #include "common/log.hpp"
+#include "common/worker_pool.hpp"
+#include "extraction_manifest.hpp"
 #include "input_ncm.hpp"
 
 #include <numeric>
-#include <ranges>
 #include <tuple>
 #include <atomic>
 #include <functional>
-#include <thread>
 #include <mutex>
 #include <optional>
 
 namespace fb2k_ncm::ui
 {
-    using cps_fn_t = std::optional<std::string>(ncm_file::ptr, threaded_process_status &, abort_callback &);
+    /// @brief Writes one output, save_raw_audio() by default.
+    using save_fn_t = bool(ncm_file::ptr, const char *to_dir, extraction_manifest &, abort_callback &);
     /// @attention File dialog callback is being executed after the function returns.
     /// Everything should be properly moved into the callback function.
-    void run_cmd_extract(metadb_handle_list_cref p_data, const GUID &p_caller, std::function<cps_fn_t> &&continuation = {}) {
-        std::vector<ncm_file::ptr> ncm_files;
+    void run_cmd_extract(metadb_handle_list_cref p_data, const GUID &p_caller, std::function<save_fn_t> &&save = {}) {
+        // NOTE: Only paths are collected here (on the UI thread), files are opened by the worker picking them up.
+        // So at most one source file per running task is open (the pool runs up to 2 tasks per core),
+        // and each handle is released as soon as its file is done.
+        struct item_st {
+            pfc::string8 path; // ncm_file keeps a pointer to it
+            uint64_t size;     // from the metadb, for scheduling
+        };
+        std::vector<item_st> items;
         for (auto item : p_data) {
             if (pfc::string_extension(item->get_path()) != "ncm") {
                 continue;
             }
-            auto ncm_file = fb2k::service_new<fb2k_ncm::ncm_file>(item->get_path());
-            ncm_files.emplace_back(std::move(ncm_file));
+            auto size = item->get_filesize();
+            items.push_back({item->get_path(), size == filesize_invalid ? 0 : size});
         }
 
-        if (ncm_files.empty()) {
+        if (items.empty()) {
             return;
         }
 
-        const auto total = ncm_files.size();
+        const auto total = items.size();
 
         auto file_dialog = fb2k::fileDialog::get()->setupOpenFolder();
-        file_dialog->setTitle(PFC_string_formatter() << "Save " << ncm_files.size() << " audio file(s) to...");
+        file_dialog->setTitle(PFC_string_formatter() << "Save " << total << " audio file(s) to...");
         file_dialog->runSimple(
-            [total, cps_params = std::make_tuple(std::move(continuation), std::move(ncm_files))](fb2k::stringRef selected_path) {
+            [total, cps_params = std::make_tuple(std::move(save), std::move(items))](fb2k::stringRef selected_path) {
                 // file dialog callback
 
                 auto _process = [total, cps_params = std::move(cps_params),
                                  path = std::string(selected_path->c_str())](threaded_process_status &p_status, abort_callback &p_abort) {
                     // NOTE: Since both p_status and p_abort are for message notifying, they are supposed to be thread-safe.
-                    auto [continuation, ncm_files] = cps_params;
+                    auto [save, items] = cps_params;
                     std::atomic_bool all_done = true;
-                    std::atomic_uint32_t exclusive_index = 0;
                     std::atomic_uint32_t finished_count = 0;
 
                     std::mutex m_succ, m_fail;
                     std::vector<std::string> succs, fails;
+                    // files extracted before (and unchanged) are skipped, interrupted ones continued
+                    extraction_manifest manifest(path.c_str(), p_abort);
 
-                    auto worker = [&](threaded_process_status &p_status, abort_callback &p_abort) {
-                        DEBUG_LOG("Extraction worker thread started.");
+                    auto extract_one = [&](const char *source_path) {
+                        if (p_abort.is_aborting()) {
+                            all_done = false;
+                            return;
+                        }
+                        ncm_file::ptr f;
                         try {
-                            for (auto index = exclusive_index++; index < total; index = exclusive_index++) {
-                                p_abort.check();
-                                auto &f = ncm_files[index];
-                                if (auto ok = f->save_raw_audio(path.c_str(), p_abort); !ok) {
-                                    bool expect_true = true;
-                                    all_done.compare_exchange_strong(expect_true, false);
-                                    std::lock_guard lock(m_fail);
-                                    fails.emplace_back(f->path());
-                                } else {
-                                    // invoke CPS function
-                                    if (continuation) {
-                                        if (auto result = continuation(f, p_status, p_abort); !result.has_value()) {
-                                            bool expect_true = true;
-                                            all_done.compare_exchange_strong(expect_true, false);
-                                            std::lock_guard lock(m_fail);
-                                            fails.emplace_back(f->path());
-                                        } else {
-                                            std::lock_guard lock(m_succ);
-                                            succs.emplace_back(*result); // NOTE: output dir
-                                        }
-                                    } else {
-                                        std::lock_guard lock(m_succ);
-                                        succs.emplace_back(f->saved_raw_path()); // NOTE: output dir
-                                    }
-                                }
-
-                                p_status.set_progress(++finished_count, total);
-                                p_status.set_title(PFC_string_formatter()
-                                                   << "Extracting audio files (" << finished_count << " of " << total << ")");
+                            f = fb2k::service_new<ncm_file>(source_path);
+                            const bool ok =
+                                save ? save(f, path.c_str(), manifest, p_abort) : f->save_raw_audio(path.c_str(), p_abort, &manifest);
+                            if (!ok) {
+                                all_done = false;
+                                std::lock_guard lock(m_fail);
+                                fails.emplace_back(f->path());
+                            } else {
+                                std::lock_guard lock(m_succ);
+                                succs.emplace_back(f->saved_raw_path()); // NOTE: output dir
                             }
-                            DEBUG_LOG("Extraction worker thread ended normally.");
                         } catch (const exception_aborted &) {
-                            DEBUG_LOG("Extraction worker aborted (p_abort)");
+                            DEBUG_LOG("Extraction aborted (p_abort): ", source_path);
                             all_done = false;
+                            return;
                         } catch (const std::exception &e) {
-                            ERROR_LOG("Extraction worker failed: ", e.what());
+                            ERROR_LOG("Extraction failed (", e.what(), "): ", source_path);
                             all_done = false;
+                            std::lock_guard lock(m_fail);
+                            fails.emplace_back(source_path);
                         }
-                    };
+                        f.release(); // close it before reporting progress
 
-                    // choose the greater one
-                    size_t thread_count = fb2k_ncm::max_thread_count > std::thread::hardware_concurrency()
-                                              ? fb2k_ncm::max_thread_count
-                                              : std::thread::hardware_concurrency();
-                    thread_count = thread_count > total ? total : thread_count;
-                    DEBUG_LOG("Extraction main thread: scheduling ", thread_count, " threads.");
+                        p_status.set_progress(++finished_count, total);
+                        p_status.set_title(PFC_string_formatter()
+                                           << "Extracting audio files (" << finished_count << " of " << total << ")");
+                    };
 
-                    std::vector<std::thread> threads;
-                    // slicing is still extreamly complicated! - rather not to imitate the [a:b:c] syntax :(
-                    for ([[maybe_unused]] auto _ : std::views::iota(0) | std::views::take(thread_count)) {
-                        threads.emplace_back(worker, std::ref(p_status), std::ref(p_abort));
-                    }
-                    for (auto &t : threads) {
-                        t.join();
+                    // largest files first, see worker_pool
+                    std::vector<worker_pool::task_st> tasks;
+                    for (const auto &item : items) {
+                        tasks.push_back({item.size, [&extract_one, &item] { extract_one(item.path.c_str()); }});
                     }
+                    DEBUG_LOG("Extraction main thread: scheduling ", total, " files on ", worker_pool::instance().concurrency(),
+                              " workers.");
+                    worker_pool::instance().run_batch(std::move(tasks));
                     DEBUG_LOG("Extraction main thread: all workers finished.");
+                    manifest.save(true);
                     pfc::string8 msg;
                     if (all_done) {
                         msg << "All audio content have been extracted successfully.\n\n";
@@ -141,68 +136,28 @@ namespace fb2k_ncm::ui
             }); // end of file dialog callback
     }
     void run_cmd_extract_retag(metadb_handle_list_cref p_data, const GUID &p_caller) {
-        run_cmd_extract(
-            p_data, p_caller,
-            [](ncm_file::ptr ncm_file, threaded_process_status &p_status, abort_callback &p_abort) -> std::optional<std::string> {
-                DEBUG_LOG("Retagging ", ncm_file->saved_raw_path().data());
+        // Tags and cover are written in front of the audio while extracting, so each file is written once, sequentially.
+        run_cmd_extract(p_data, p_caller, [](ncm_file::ptr ncm_file, const char *to_dir, extraction_manifest &manifest, abort_callback &p_abort) {
+            DEBUG_LOG("Extracting with tags ", ncm_file->path());
 
-                if (p_abort.is_aborting()) {
-                    DEBUG_LOG("Retagging aborted (p_abort)");
-                    return {};
-                }
-                // p_status.set_title(PFC_string_formatter() << "Retagging (" << finished_count << " of " << total << ")");
-
-                auto input = input_entry::g_find_by_guid(input_ncm::class_guid);
-                service_ptr_t<input_info_reader> info_reader;
-                input->open_for_info_read(info_reader, ncm_file, "", p_abort);
-                file_info_impl info;
-                info_reader->get_info(0, info, p_abort);
-
-                // try to correct file extension if possible
-                pfc::string codec;
-                info.info_get_codec_long(codec);
-                if (codec.toLower().contains("mp3")) {
-                    codec = "mp3";
-                } else if (codec.toLower().contains("flac")) {
-                    codec = "flac";
-                }
-
-                const char *o_path = ncm_file->saved_raw_path().data();
-                auto to_retag = pfc::string_directory(o_path);
-                to_retag.add_filename(pfc::string_filename(o_path));
-                to_retag << "." << codec;
-                if (to_retag.empty()) {
-                    DEBUG_LOG("Not extracted:", ncm_file->path());
-                    return {};
-                }
+            auto input = input_entry::g_find_by_guid(input_ncm::class_guid);
+            service_ptr_t<input_info_reader> info_reader;
+            input->open_for_info_read(info_reader, ncm_file, "", p_abort);
+            file_info_impl info;
+            info_reader->get_info(0, info, p_abort);
+            info_reader = nullptr;
 
+            // embedded album art
+            album_art_data_ptr cover;
+            if (auto album_extractor = album_art_extractor::g_open(ncm_file, ncm_file->path(), p_abort); album_extractor.is_valid()) {
                 try {
-                    if (to_retag != ncm_file->saved_raw_path().data()) {
-                        filesystem::get(to_retag)->move_overwrite(ncm_file->saved_raw_path().data(), to_retag, p_abort);
-                    }
-
-                    service_ptr_t<input_info_writer> retagger;
-                    input_entry::g_open_for_info_write(retagger, file_ptr(), to_retag, p_abort);
-                    retagger->set_info(0, info, p_abort);
-                    retagger->commit(fb2k::noAbort); // do not interrupt committing
-                    retagger = nullptr;              // release, to let album editor reopen the file
-
-                    // embedded album art
-                    auto album_extractor = album_art_extractor::g_open(ncm_file, ncm_file->path(), p_abort);
-                    auto album_writer = album_art_editor::g_open(nullptr, to_retag, p_abort);
-                    if (album_extractor.is_valid() && album_writer.is_valid()) {
-                        if (auto data = album_extractor->query(album_art_ids::cover_front, p_abort); data.is_valid()) {
-                            album_writer->set(album_art_ids::cover_front, data, p_abort);
-                            album_writer->commit(fb2k::noAbort); // do not interrupt committing
-                        }
-                    }
-                    DEBUG_LOG("Retagged ", to_retag);
-                    return {std::string(to_retag.c_str())};
-                } catch (const pfc::exception &e) {
-                    ERROR_LOG("(", e.what(), ") Failed to retag ", to_retag);
+                    cover = album_extractor->query(album_art_ids::cover_front, p_abort);
+                } catch (const exception_album_art_not_found &) {
+                    // tags only
                 }
-                return {};
-            });
+            }
+            return ncm_file->save_tagged_audio(to_dir, info, cover, p_abort, &manifest);
+        });
     }
 } // namespace fb2k_ncm::ui
 
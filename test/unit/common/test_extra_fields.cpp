@@ -0,0 +1,48 @@
+#include "stdafx.h"
+#include "gtest/gtest.h"
+#include "common/extra_fields.hpp"
+
+#include <algorithm>
+
+using namespace fb2k_ncm;
+
+// ncm meta keeps the case of names, file_info makes them upper case
+class ExtraFieldsTest : public ::testing::Test {
+protected:
+    std::unordered_map<std::string, std::string> cur_single_{{"albumPicDocId", "109951163"}, {"publishTime", "0"}};
+    std::unordered_map<std::string, extra_fields::values_t> cur_multi_{{"flag", {"a", "b"}}, {"tns", {"x"}}};
+    std::unordered_map<std::string, std::string> target_single_{{"ALBUMPICDOCID", "109951163"}, {"PUBLISHTIME", "0"}, {"TNS", "x"}};
+    std::unordered_map<std::string, extra_fields::values_t> target_multi_{{"FLAG", {"b", "a"}}};
+
+    const extra_fields::change_st *find(const std::vector<extra_fields::change_st> &changes, std::string_view name) {
+        auto it = std::find_if(changes.begin(), changes.end(), [&](const auto &c) { return c.name == name; });
+        return it == changes.end() ? nullptr : &*it;
+    }
+};
+
+TEST_F(ExtraFieldsTest, UnchangedIsEmpty) {
+    EXPECT_TRUE(extra_fields::diff(cur_single_, cur_multi_, target_single_, target_multi_).empty());
+    EXPECT_TRUE(extra_fields::diff(cur_single_, cur_multi_, cur_single_, cur_multi_).empty());
+}
+
+TEST_F(ExtraFieldsTest, ChangedKeepsOriginalName) {
+    target_single_["ALBUMPICDOCID"] = "42";
+    const auto changes = extra_fields::diff(cur_single_, cur_multi_, target_single_, target_multi_);
+    ASSERT_EQ(changes.size(), 1u);
+    EXPECT_EQ(changes[0].name, "albumPicDocId");
+    ASSERT_TRUE(changes[0].values.has_value());
+    EXPECT_EQ(*changes[0].values, extra_fields::values_t{"42"});
+}
+
+TEST_F(ExtraFieldsTest, AddedAndRemoved) {
+    target_single_.erase("PUBLISHTIME");
+    target_single_["NEWFIELD"] = "1";
+    const auto changes = extra_fields::diff(cur_single_, cur_multi_, target_single_, target_multi_);
+    ASSERT_EQ(changes.size(), 2u);
+    const auto removed = find(changes, "publishTime");
+    ASSERT_NE(removed, nullptr);
+    EXPECT_FALSE(removed->values.has_value());
+    const auto added = find(changes, "NEWFIELD");
+    ASSERT_NE(added, nullptr);
+    EXPECT_EQ(*added->values, extra_fields::values_t{"1"});
+}
@@ -0,0 +1,91 @@
+#include "stdafx.h"
+#include "gtest/gtest.h"
+#include "cipher/meta_codec.hpp"
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace fb2k_ncm::cipher;
+using namespace std::string_view_literals;
+
+class MetaCodecTest : public ::testing::Test {
+protected:
+    static constexpr uint8_t key_[] = {0x23, 0x31, 0x34, 0x6C, 0x6A, 0x6B, 0x5F, 0x21, 0x5C, 0x5D, 0x26, 0x30, 0x55, 0x3C, 0x27, 0x28};
+    meta_codec codec_{key_, "163 key(Don't modify):"sv};
+
+    std::vector<uint8_t> encode(std::string_view json) const {
+        std::vector<uint8_t> field;
+        codec_.encode({"music:"sv, json}, [&](const uint8_t *p, size_t n) { field.insert(field.end(), p, p + n); });
+        return field;
+    }
+
+    static std::string make_json(size_t size) {
+        std::string json = "{\"musicName\":\"";
+        for (size_t i = 0; json.size() + 2 < size; ++i) {
+            json.push_back(static_cast<char>('a' + i % 26));
+        }
+        return json + "\"}";
+    }
+};
+
+TEST_F(MetaCodecTest, RoundTrip) {
+    // one chunk, exactly one chunk of padded plain text, then several chunks
+    for (size_t size : {size_t{2}, size_t{100}, meta_codec::chunk_size - 16 - 6, meta_codec::chunk_size + 1, size_t{10000}}) {
+        const auto json = make_json(size);
+        const auto field = encode(json);
+        EXPECT_EQ(field.size(), codec_.encoded_size(6 + json.size()));
+
+        std::string plain;
+        ASSERT_EQ(codec_.decode(field, plain), meta_codec::status::ok) << "size: " << size;
+        EXPECT_EQ(plain, "music:" + json);
+    }
+}
+
+TEST_F(MetaCodecTest, PaddingOnlyAtTheEnd) {
+    const auto field = encode(make_json(meta_codec::chunk_size * 2));
+    std::string text(field.size(), '\0');
+    std::transform(field.begin(), field.end(), text.begin(), [](uint8_t b) { return char(b ^ meta_codec::xor_key); });
+    ASSERT_TRUE(text.starts_with("163 key(Don't modify):"));
+    const auto pad = text.find('=');
+    EXPECT_TRUE(pad == std::string::npos || pad >= text.size() - 2);
+}
+
+TEST_F(MetaCodecTest, RejectsBadInput) {
+    auto field = encode(make_json(5000));
+    std::string plain;
+
+    auto bad_hint = field;
+    bad_hint[0] ^= 1;
+    EXPECT_EQ(codec_.decode(bad_hint, plain), meta_codec::status::hint);
+
+    // truncated to a size that's not a multiple of the AES block
+    std::vector<uint8_t> truncated(field.begin(), field.end() - 8);
+    EXPECT_EQ(codec_.decode(truncated, plain), meta_codec::status::cipher);
+
+    auto bad_char = field;
+    bad_char[40] = '!' ^ meta_codec::xor_key;
+    EXPECT_EQ(codec_.decode(bad_char, plain), meta_codec::status::cipher);
+
+    // valid base64 and AES, but the last byte claims more padding than a block
+    std::vector<uint8_t> block(AES_BLOCKSIZE, 0x20);
+    make_AES_context_with_key(std::vector<uint8_t>(std::begin(key_), std::end(key_)))
+        .set_chain_mode(aes_chain_mode::ECB)
+        .set_input(block.data(), block.size())
+        .set_output(block.data(), block.size())
+        .encrypt_chunk(block.size());
+    std::string text = "163 key(Don't modify):";
+    constexpr char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (size_t i = 0; i < block.size(); i += 3) {
+        const uint32_t v = (uint32_t(block[i]) << 16) | (i + 1 < block.size() ? uint32_t(block[i + 1]) << 8 : 0) |
+                           (i + 2 < block.size() ? block[i + 2] : 0);
+        text += table[v >> 18];
+        text += table[(v >> 12) & 0x3f];
+        text += i + 1 < block.size() ? table[(v >> 6) & 0x3f] : '=';
+        text += i + 2 < block.size() ? table[v & 0x3f] : '=';
+    }
+    std::vector<uint8_t> bad_padding(text.size());
+    std::transform(text.begin(), text.end(), bad_padding.begin(), [](char c) { return uint8_t(c ^ meta_codec::xor_key); });
+    EXPECT_EQ(codec_.decode(bad_padding, plain), meta_codec::status::cipher);
+}
@@ -0,0 +1,174 @@
+#include "stdafx.h"
+#include "gtest/gtest.h"
+#include "common/tag_builder.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace fb2k_ncm;
+using namespace std::string_view_literals;
+
+class TagBuilderTest : public ::testing::Test {
+protected:
+    struct block_st {
+        uint8_t type = 0;
+        bool last = false;
+        std::vector<uint8_t> body;
+    };
+
+    static void put_block(std::vector<uint8_t> &out, uint8_t type, size_t size, uint8_t fill = 0) {
+        out.insert(out.end(), {type, uint8_t(size >> 16), uint8_t(size >> 8), uint8_t(size)});
+        out.resize(out.size() + size, fill);
+    }
+
+    static std::vector<block_st> parse_blocks(const std::vector<uint8_t> &header) {
+        std::vector<block_st> blocks;
+        for (size_t pos = 4; pos + 4 <= header.size();) {
+            const size_t size = size_t(header[pos + 1]) << 16 | size_t(header[pos + 2]) << 8 | header[pos + 3];
+            EXPECT_LE(pos + 4 + size, header.size());
+            blocks.push_back({uint8_t(header[pos] & 0x7f), bool(header[pos] & 0x80), {&header[pos + 4], &header[pos + 4] + size}});
+            pos += 4 + size;
+            if (blocks.back().last) {
+                EXPECT_EQ(pos, header.size());
+                break;
+            }
+        }
+        return blocks;
+    }
+
+    static uint32_t le32(const uint8_t *p) { return uint32_t(p[3]) << 24 | uint32_t(p[2]) << 16 | uint32_t(p[1]) << 8 | p[0]; }
+
+    /// @return vendor, then the comments
+    static std::vector<std::string> parse_comments(const std::vector<uint8_t> &body) {
+        std::vector<std::string> r;
+        size_t pos = 0;
+        auto next = [&] {
+            const auto n = le32(&body[pos]);
+            r.emplace_back(reinterpret_cast<const char *>(&body[pos + 4]), n);
+            pos += 4 + n;
+        };
+        next();
+        const auto count = le32(&body[pos]);
+        pos += 4;
+        for (uint32_t i = 0; i < count; ++i) {
+            next();
+        }
+        EXPECT_EQ(pos, body.size());
+        return r;
+    }
+
+    tag_builder::fields_t fields_{
+        {"title", {"Song"}},
+        {"artist", {"A", "B"}},
+        {"tracknumber", {"3"}},
+        {"totaltracks", {"12"}},
+        {"REPLAYGAIN_TRACK_GAIN", {"-6.50 dB"}},
+    };
+    std::vector<uint8_t> cover_{0xff, 0xd8, 0xff, 0xe0, 1, 2, 3};
+};
+
+TEST_F(TagBuilderTest, FlacHeader) {
+    std::vector<uint8_t> blocks;
+    put_block(blocks, 0, 34, 0x11); // STREAMINFO
+    put_block(blocks, 3, 18, 0x33); // SEEKTABLE
+    std::vector<uint8_t> comment;
+    comment.insert(comment.end(), {7, 0, 0, 0});
+    comment.insert(comment.end(), {'e', 'n', 'c', 'o', 'd', 'e', 'r', 0, 0, 0, 0});
+    blocks.insert(blocks.end(), {4, 0, 0, uint8_t(comment.size())});
+    blocks.insert(blocks.end(), comment.begin(), comment.end());
+    put_block(blocks, 0x80 | 1, 100); // PADDING, last
+
+    const auto header = tag_builder::flac_header(blocks, fields_, cover_);
+    ASSERT_TRUE(header.has_value());
+    ASSERT_EQ(0, memcmp(header->data(), "fLaC", 4));
+    const auto parsed = parse_blocks(*header);
+    ASSERT_EQ(parsed.size(), 5u);
+    EXPECT_EQ(parsed[0].type, 0);
+    EXPECT_EQ(parsed[0].body, std::vector<uint8_t>(34, 0x11));
+    EXPECT_EQ(parsed[1].type, 3);
+    EXPECT_EQ(parsed[2].type, 4);
+    EXPECT_EQ(parsed[3].type, 6);
+    EXPECT_EQ(parsed[4].type, 1);
+    EXPECT_TRUE(parsed[4].last);
+
+    const auto comments = parse_comments(parsed[2].body);
+    const std::vector<std::string> expected{
+        "encoder", "TITLE=Song", "ARTIST=A", "ARTIST=B", "TRACKNUMBER=3", "TOTALTRACKS=12", "REPLAYGAIN_TRACK_GAIN=-6.50 dB"};
+    EXPECT_EQ(comments, expected);
+
+    const auto &picture = parsed[3].body;
+    ASSERT_GE(picture.size(), cover_.size());
+    EXPECT_TRUE(std::equal(cover_.begin(), cover_.end(), picture.end() - cover_.size()));
+    EXPECT_NE(std::string(picture.begin(), picture.end()).find("image/jpeg"), std::string::npos);
+}
+
+TEST_F(TagBuilderTest, FlacHeaderKeepsCoverWhenNewOneDoesntFit) {
+    std::vector<uint8_t> blocks;
+    put_block(blocks, 0, 34, 0x11);        // STREAMINFO
+    put_block(blocks, 0x80 | 6, 40, 0x66); // PICTURE, last
+    std::fill_n(blocks.begin() + 4 + 34 + 4, 4, 0);
+    blocks[4 + 34 + 4 + 3] = 3; // picture type: front cover
+
+    const std::vector<uint8_t> huge(tag_builder::flac_max_block_size, 0xff);
+    ASSERT_FALSE(tag_builder::flac_picture_fits(huge));
+    const auto header = tag_builder::flac_header(blocks, fields_, huge);
+    ASSERT_TRUE(header.has_value());
+    const auto parsed = parse_blocks(*header);
+    ASSERT_EQ(parsed.size(), 4u);
+    EXPECT_EQ(parsed[1].type, 6);
+    EXPECT_EQ(parsed[1].body, std::vector<uint8_t>(blocks.begin() + 4 + 34 + 4, blocks.end()));
+    EXPECT_EQ(parsed[2].type, 4);
+    EXPECT_EQ(parsed[3].type, 1);
+
+    // replaced by one that fits
+    const auto replaced = parse_blocks(*tag_builder::flac_header(blocks, fields_, cover_));
+    ASSERT_EQ(replaced.size(), 4u);
+    EXPECT_EQ(replaced[1].type, 4);
+    EXPECT_EQ(replaced[2].type, 6);
+    EXPECT_TRUE(std::equal(cover_.begin(), cover_.end(), replaced[2].body.end() - cover_.size()));
+}
+
+TEST_F(TagBuilderTest, FlacHeaderMalformed) {
+    std::vector<uint8_t> no_streaminfo;
+    put_block(no_streaminfo, 0x80 | 1, 10);
+    EXPECT_FALSE(tag_builder::flac_header(no_streaminfo, fields_, {}).has_value());
+
+    std::vector<uint8_t> truncated;
+    put_block(truncated, 0x80, 34);
+    truncated.resize(truncated.size() - 1);
+    EXPECT_FALSE(tag_builder::flac_header(truncated, fields_, {}).has_value());
+
+    std::vector<uint8_t> invalid_type;
+    put_block(invalid_type, 0, 34);
+    put_block(invalid_type, 0x80 | 127, 0);
+    EXPECT_FALSE(tag_builder::flac_header(invalid_type, fields_, {}).has_value());
+
+    EXPECT_FALSE(tag_builder::flac_block_size(std::array<uint8_t, 4>{0xff, 0, 0, 1}).has_value());
+    EXPECT_EQ(tag_builder::flac_block_size(std::array<uint8_t, 4>{0x86, 1, 2, 3}), 0x010203u);
+}
+
+TEST_F(TagBuilderTest, Id3v2Tag) {
+    const auto tag = tag_builder::id3v2_tag(fields_, cover_);
+    ASSERT_GE(tag.size(), 10u);
+    ASSERT_EQ(0, memcmp(tag.data(), "ID3\x04\x00\x00", 6));
+    EXPECT_EQ(tag_builder::id3v2_size(std::span<const uint8_t, 10>(tag.data(), 10)), tag.size());
+
+    const std::string text(tag.begin(), tag.end());
+    EXPECT_NE(text.find("TIT2"), std::string::npos);
+    EXPECT_NE(text.find("A\0B"sv), std::string::npos); // multiple values
+    EXPECT_NE(text.find("3/12"), std::string::npos);  // track number with total
+    EXPECT_NE(text.find("REPLAYGAIN_TRACK_GAIN\0-6.50 dB"sv), std::string::npos);
+    EXPECT_NE(text.find("APIC"), std::string::npos);
+    EXPECT_EQ(text.find("TOTALTRACKS"), std::string::npos); // merged into TRCK
+}
+
+TEST_F(TagBuilderTest, Id3v2Size) {
+    const uint8_t none[10] = {'f', 'L', 'a', 'C'};
+    EXPECT_EQ(tag_builder::id3v2_size(none), 0u);
+    const uint8_t with_footer[10] = {'I', 'D', '3', 4, 0, 0x10, 0, 0, 1, 0x7f};
+    EXPECT_EQ(tag_builder::id3v2_size(with_footer), 10u + 0xff + 10);
+}
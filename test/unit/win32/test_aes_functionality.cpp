@@ -1,6 +1,8 @@
 #include "stdafx.h"
 #include "gtest/gtest.h"
 #include "cipher/aes.hpp"
+#include "cipher/abnormal_RC4.hpp"
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -333,4 +335,27 @@ TEST_F(AESFuncitoalityTest, Falses) {
     } catch (const fb2k_ncm::cipher::cipher_error &e) {
         SUCCEED() << e.what();
     }
-}
\ No newline at end of file
+}
+
+// apply() works on whole periods internally, it must still match the byte-wise transform for any offset and length
+TEST(AbnormalRC4Test, ApplyMatchesTransform) {
+    std::vector<uint8_t> seed(128);
+    ASSERT_GE(BCryptGenRandom(NULL, seed.data(), (ULONG)seed.size(), BCRYPT_USE_SYSTEM_PREFERRED_RNG), 0);
+    const fb2k_ncm::cipher::abnormal_RC4 rc4(seed);
+    ASSERT_TRUE(rc4.is_valid());
+    const auto tf = rc4.get_transform();
+
+    std::vector<uint8_t> data(4096 + 7);
+    ASSERT_GE(BCryptGenRandom(NULL, data.data(), (ULONG)data.size(), BCRYPT_USE_SYSTEM_PREFERRED_RNG), 0);
+    for (size_t offset : {0, 1, 15, 255, 256, 257, 1000, 65537}) {
+        for (size_t len : {0, 1, 3, 255, 256, 257, 511, 1000, 4096 + 7}) {
+            auto applied = std::vector<uint8_t>(data.begin(), data.begin() + len);
+            rc4.apply(applied.data(), len, offset);
+            for (size_t i = 0; i < len; ++i) {
+                ASSERT_EQ(applied[i], tf(data[i], offset + i)) << "offset: " << offset << ", len: " << len << ", at: " << i;
+            }
+            rc4.apply(applied.data(), len, offset);
+            ASSERT_TRUE(std::equal(applied.begin(), applied.end(), data.begin()));
+        }
+    }
+}